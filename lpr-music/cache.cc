@@ -0,0 +1,279 @@
+/*
+ * Transcode Cache
+ *
+ * The print filter hands us whatever lpd was given, usually not ADTS.  Songs
+ * from the shared queue come back again and again, so every rendition ffmpeg
+ * produces is kept under the SHA-256 of its source:
+ *
+ *   DIR/.lock              flock(2), shared while a rendition is in use and
+ *                          exclusive while evicting
+ *   DIR/<sha256>.aac       ADTS rendition, mtime is the last time it played
+ *   DIR/.src.XXXXXX        Source being spooled and hashed
+ *   DIR/.out.XXXXXX        Rendition being written by ffmpeg
+ *
+ * The source has to be read to the end before we know its key, so it is
+ * spooled to a temporary file while it is hashed.  On a miss ffmpeg writes
+ * the rendition next to the cache entry as it encodes and it is renamed into
+ * place once complete, so a reader never sees a partial rendition.  Two jobs
+ * transcoding the same song both rename identical files over each other.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "cache.h"
+#include "sha256.h"
+#include "speakers.h"
+
+using namespace std;
+
+TranscodeCache::TranscodeCache(const char *dir, int64_t maxBytes)
+    : dir(dir), maxBytes(maxBytes), lockFd(-1)
+{
+}
+
+TranscodeCache::~TranscodeCache()
+{
+    if (lockFd >= 0)
+        close(lockFd);
+}
+
+/*
+ * transcode -- Return in path an ADTS rendition of everything read from src,
+ * from the cache or fresh from ffmpeg.  The rendition stays in place until
+ * release().
+ */
+bool
+TranscodeCache::transcode(int src, string *path)
+{
+    string tmp, key, out;
+    int fd;
+
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        perror("mkdir cache");
+        return false;
+    }
+    lockFd = open((dir + "/.lock").c_str(), O_RDWR | O_CREAT, 0644);
+    if (lockFd < 0) {
+        perror("open cache lock");
+        return false;
+    }
+
+    if (!spool(src, &tmp, &key))
+        return false;
+    *path = dir + "/" + key + ".aac";
+
+    flock(lockFd, LOCK_SH);
+    if (access(path->c_str(), R_OK) == 0) {
+        // Touch it, eviction goes by last play
+        utimes(path->c_str(), nullptr);
+        unlink(tmp.c_str());
+        printf("Cached %s\n", path->c_str());
+        return true;
+    }
+    flock(lockFd, LOCK_UN);
+
+    out = dir + "/.out.XXXXXX";
+    fd = mkstemp(&out[0]);
+    if (fd < 0) {
+        perror("mkstemp");
+        unlink(tmp.c_str());
+        return false;
+    }
+    close(fd);
+
+    printf("Transcoding into %s\n", path->c_str());
+    if (!encode(tmp, out)) {
+        unlink(out.c_str());
+        unlink(tmp.c_str());
+        return false;
+    }
+    unlink(tmp.c_str());
+
+    chmod(out.c_str(), 0644);
+    if (rename(out.c_str(), path->c_str()) < 0) {
+        perror("rename");
+        unlink(out.c_str());
+        return false;
+    }
+
+    flock(lockFd, LOCK_EX);
+    evict(*path);
+    flock(lockFd, LOCK_SH);
+
+    return true;
+}
+
+/*
+ * release -- The rendition has been read, it may be evicted again.
+ */
+void
+TranscodeCache::release()
+{
+    if (lockFd >= 0) {
+        close(lockFd);
+        lockFd = -1;
+    }
+}
+
+/*
+ * spool -- Copy src to a temporary file in the cache, returned in tmp, and
+ * hash it into key.
+ */
+bool
+TranscodeCache::spool(int src, string *tmp, string *key)
+{
+    Sha256 hash;
+    char buf[64 * 1024];
+    int fd;
+    ssize_t len;
+    bool ok = true;
+
+    *tmp = dir + "/.src.XXXXXX";
+    fd = mkstemp(&(*tmp)[0]);
+    if (fd < 0) {
+        perror("mkstemp");
+        return false;
+    }
+
+    hash.update(TRANSCODE_VERSION, sizeof(TRANSCODE_VERSION));
+    while ((len = read(src, buf, sizeof(buf))) != 0) {
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("read source");
+            ok = false;
+            break;
+        }
+        hash.update(buf, len);
+        if (!Write_All(fd, buf, len)) {
+            ok = false;
+            break;
+        }
+    }
+    close(fd);
+
+    if (!ok) {
+        unlink(tmp->c_str());
+        return false;
+    }
+
+    *key = hash.hex();
+    return true;
+}
+
+/*
+ * encode -- Run ffmpeg from in to ADTS AAC in out.
+ */
+bool
+TranscodeCache::encode(const string &in, const string &out)
+{
+    pid_t pid;
+    int status;
+
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return false;
+    }
+    if (pid == 0) {
+        execl(TRANSCODE_FFMPEG, "ffmpeg", "-nostdin", "-loglevel", "error",
+              "-y", "-i", in.c_str(), "-vn", "-codec:a", "aac", "-f", "adts",
+              out.c_str(), (char *)nullptr);
+        perror("exec " TRANSCODE_FFMPEG);
+        _exit(127);
+    }
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            perror("waitpid");
+            return false;
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("ffmpeg failed on %s\n", in.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * evict -- Remove the least recently played renditions until the cache fits
+ * in maxBytes, never keep, and temporary files crashed jobs left behind.
+ * Caller holds the lock exclusively.
+ */
+void
+TranscodeCache::evict(const string &keep)
+{
+    struct Entry
+    {
+        string path;
+        off_t size;
+        time_t mtime;
+    };
+    vector<Entry> entries;
+    int64_t total = 0;
+    time_t now = time(nullptr);
+    struct dirent *de;
+    DIR *d;
+
+    d = opendir(dir.c_str());
+    if (d == nullptr) {
+        perror("opendir cache");
+        return;
+    }
+
+    while ((de = readdir(d)) != nullptr) {
+        string name = de->d_name;
+        string path = dir + "/" + name;
+        struct stat sb;
+
+        if (stat(path.c_str(), &sb) < 0 || !S_ISREG(sb.st_mode))
+            continue;
+
+        if (name.compare(0, 5, ".src.") == 0 ||
+            name.compare(0, 5, ".out.") == 0) {
+            if (now - sb.st_mtime > TRANSCODE_STALE)
+                unlink(path.c_str());
+            continue;
+        }
+        if (name.size() != 2 * SHA256_DIGEST + 4 ||
+            name.compare(2 * SHA256_DIGEST, 4, ".aac") != 0)
+            continue;
+
+        entries.push_back({ path, sb.st_size, sb.st_mtime });
+        total += sb.st_size;
+    }
+    closedir(d);
+
+    sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+        return a.mtime < b.mtime;
+    });
+
+    for (auto &&e : entries) {
+        if (total <= maxBytes)
+            break;
+        if (e.path == keep)
+            continue;
+        if (unlink(e.path.c_str()) == 0) {
+            printf("Evicted %s\n", e.path.c_str());
+            total -= e.size;
+        }
+    }
+}
+
@@ -0,0 +1,46 @@
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdint.h>
+
+#include <string>
+
+#define TRANSCODE_CACHE     "/var/cache/lpr-music"
+#define TRANSCODE_CACHE_MB  1024
+#define TRANSCODE_FFMPEG    "/usr/local/bin/ffmpeg"
+
+// Part of every key, change it with the ffmpeg settings to start afresh
+#define TRANSCODE_VERSION   "ffmpeg aac adts 1"
+
+// Temporary files older than this are left from a crashed job (s)
+#define TRANSCODE_STALE     (24 * 60 * 60)
+
+/*
+ * TranscodeCache -- ADTS renditions of songs, keyed by the SHA-256 of the
+ * source, so a song printed again skips ffmpeg.  Safe to share between
+ * concurrent jobs: every job spools and transcodes into its own temporary
+ * files and renames the result into place, readers hold a shared lock that
+ * eviction waits for.  The least recently played renditions are evicted once
+ * the cache grows past its size limit.
+ */
+class TranscodeCache
+{
+public:
+    TranscodeCache(const char *dir, int64_t maxBytes);
+    ~TranscodeCache();
+    TranscodeCache(const TranscodeCache &) = delete;
+    TranscodeCache &operator=(const TranscodeCache &) = delete;
+    bool transcode(int src, std::string *path);
+    void release();
+private:
+    bool spool(int src, std::string *tmp, std::string *key);
+    bool encode(const std::string &in, const std::string &out);
+    void evict(const std::string &keep);
+    std::string dir;
+    int64_t maxBytes;
+    int lockFd;
+};
+
+#endif /* __CACHE_H__ */
+
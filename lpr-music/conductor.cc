@@ -0,0 +1,660 @@
+/*
+ * Conductor Mode
+ *
+ * Running lpr-music once per print job means every job rediscovers the
+ * speakers, connects to each of them, reads the reference clock and tears it
+ * all down again.  The conductor does that work once and keeps it warm:
+ *
+ *  - A maintenance thread picks up new speakers from the registry, keeps a
+ *    control connection to each and probes its clock once a second.  The
+ *    probe with the smallest round trip gives the offset between our clock
+ *    and the cluster clock, so a job no longer has to ask for it.
+ *
+ *  - lpd jobs are handed over on a local socket (see Submit_Job) and queued.
+ *
+ *  - A player thread loads each job on every speaker and schedules it right
+ *    behind the previous one, using the track length from the ADTS headers.
+ *    It stays SONG_SLOTS songs ahead, the most speakerd takes without making
+ *    a LOAD wait for a slot.  A speaker being sent a song is marked busy and
+ *    the transfer runs outside speakerLock, so probing and picking up
+ *    speakers carry on meanwhile.
+ *
+ *  - In relay mode (-R) a song is sent once, to the first speaker of a chain
+ *    ordered by address, and the speakers pass it along among themselves.
+ *    Only the speakers the chain reports as loaded are sent PLAY.
+ *
+ *  - A speaker that connects while songs are scheduled, for instance after a
+ *    restart, is sent them with their original start times.  speakerd seeks to
+ *    the current position and joins in sync.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <thread>
+
+#include "../speakerd/adts.h"
+#include "../speakerd/player.h"
+#include "../speakerd/printer.h"
+#include "conductor.h"
+
+using namespace std;
+
+#define CONDUCTOR_SAMPLES   16      // Clock probes kept per speaker
+#define CONDUCTOR_RCVTIMEO  2       // Seconds to wait for a reply
+#define CONDUCTOR_BACKLOG   16
+
+Conductor::Conductor(const char *registry, const char *sockpath, int port,
+                     int syncPort, int timeoutMs, int64_t loadRate,
+                     bool relay)
+    : registry(registry), sockpath(sockpath), port(port), syncPort(syncPort),
+      timeoutMs(timeoutMs), loadRate(loadRate), relay(relay),
+      speakerLock(), speakers(), jobLock(), jobCv(), jobs(), nextStart(0),
+      jobSeq(0), scheduled()
+{
+}
+
+Conductor::~Conductor()
+{
+    for (auto &&r : speakers) {
+        if (r.fd >= 0)
+            close(r.fd);
+    }
+}
+
+int
+Conductor::run()
+{
+    int sock;
+    int status;
+    mode_t mask;
+    struct group *grp;
+    struct sockaddr_un addr;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sockpath, sizeof(addr.sun_path) - 1);
+
+    // Created private, then opened up to the lpd group only
+    unlink(sockpath);
+    mask = umask(0177);
+    status = ::bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (status < 0) {
+        perror("bind");
+        return 1;
+    }
+
+    grp = getgrnam(MUSICPRINTER_CONDUCTOR_GROUP);
+    if (grp == nullptr) {
+        printf("No group %s, only our user may submit jobs\n",
+               MUSICPRINTER_CONDUCTOR_GROUP);
+    } else if (chown(sockpath, (uid_t)-1, grp->gr_gid) < 0) {
+        perror("chown conductor socket");
+    } else {
+        chmod(sockpath, 0660);
+    }
+
+    status = listen(sock, CONDUCTOR_BACKLOG);
+    if (status < 0) {
+        perror("listen");
+        return 1;
+    }
+
+    printf("Conductor listening on %s\n", sockpath);
+
+    thread thrMaintain(&Conductor::maintain, this);
+    thread thrPlay(&Conductor::playJobs, this);
+
+    for (;;) {
+        int client = ::accept(sock, nullptr, nullptr);
+        if (client < 0) {
+            if (errno != EINTR)
+                perror("accept");
+            continue;
+        }
+
+        receive(client);
+        close(client);
+    }
+}
+
+/*
+ * receive -- Read a job submission: the length of the path followed by the
+ * path.  The song is read right away so the caller may reuse the file as soon
+ * as we reply.
+ */
+void
+Conductor::receive(int client)
+{
+    uint32_t len;
+    char path[PATH_MAX];
+    int32_t status = -1;
+    struct stat sb;
+    int fd;
+    Job job;
+
+    if (!Read_All(client, &len, sizeof(len)) || len == 0 || len >= PATH_MAX)
+        goto reply;
+    if (!Read_All(client, path, len))
+        goto reply;
+    path[len] = '\0';
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        goto reply;
+    }
+    if (fstat(fd, &sb) < 0 || sb.st_size > MUSICPRINTER_MAXSONG) {
+        printf("%s: unreadable or larger than %d bytes\n",
+               path, MUSICPRINTER_MAXSONG);
+        close(fd);
+        goto reply;
+    }
+
+    job.path = path;
+    job.song = make_shared<vector<char>>(sb.st_size);
+    if (!Read_All(fd, job.song->data(), job.song->size())) {
+        close(fd);
+        goto reply;
+    }
+    close(fd);
+
+    job.duration = ADTS_Duration(job.song->data(), job.song->size());
+    job.start = 0;
+    if (job.duration == 0) {
+        printf("%s: not an ADTS stream\n", path);
+        goto reply;
+    }
+
+    printf("Queued %s (%lld ms)\n", path, (long long)job.duration / 1000);
+    {
+        lock_guard<mutex> lk(jobLock);
+        jobs.push_back(move(job));
+    }
+    jobCv.notify_one();
+    status = 0;
+
+reply:
+    Write_All(client, &status, sizeof(status));
+}
+
+void
+Conductor::maintain()
+{
+    for (;;) {
+        refresh();
+
+        {
+            lock_guard<mutex> lk(speakerLock);
+            for (auto &&r : speakers) {
+                probe(r);
+            }
+            speakers.erase(remove_if(speakers.begin(), speakers.end(),
+                                     [](const Remote &r) { return r.fd < 0; }),
+                           speakers.end());
+        }
+
+        sleep(1);
+    }
+}
+
+/*
+ * refresh -- Connect to live speakers we do not have a connection to yet.
+ */
+void
+Conductor::refresh()
+{
+    vector<uint32_t> ips = Find_Speakers(registry, syncPort);
+    vector<uint32_t> fresh;
+    vector<Speaker> conns;
+
+    {
+        lock_guard<mutex> lk(speakerLock);
+        for (auto &&ip : ips) {
+            auto it = find_if(speakers.begin(), speakers.end(),
+                              [ip](const Remote &r) { return r.ip == ip; });
+            if (it == speakers.end())
+                fresh.push_back(ip);
+        }
+    }
+
+    if (fresh.empty())
+        return;
+
+    conns = Connect_Speakers(fresh, port, timeoutMs);
+
+    {
+        lock_guard<mutex> lk(speakerLock);
+        for (auto &&c : conns) {
+            struct timeval tv = { CONDUCTOR_RCVTIMEO, 0 };
+
+            setsockopt(c.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            speakers.push_back(Remote{ c.ip, c.fd, {}, true, 0 });
+            printf("Speaker %x connected\n", c.ip);
+        }
+    }
+
+    for (auto &&c : conns) {
+        catchUp(c.ip);
+    }
+}
+
+/*
+ * catchUp -- Send a busy speaker the scheduled songs it has not been sent
+ * that are still playing, then mark it idle.  Songs scheduled while it
+ * catches up are picked up as well.
+ */
+void
+Conductor::catchUp(uint32_t ip)
+{
+    for (;;) {
+        Job job;
+        int fd;
+        bool found = false;
+
+        {
+            lock_guard<mutex> lk(speakerLock);
+            auto r = find_if(speakers.begin(), speakers.end(),
+                             [ip](const Remote &r) {
+                                 return r.ip == ip && r.fd >= 0 && r.busy;
+                             });
+            int64_t now;
+
+            if (r == speakers.end())
+                return;
+
+            now = clusterTime();
+            for (auto &&j : scheduled) {
+                if (j.seq < r->next)
+                    continue;
+                r->next = j.seq + 1;
+                if (j.start + j.duration <= now)
+                    continue;
+                job = j;
+                found = true;
+                break;
+            }
+            if (!found) {
+                r->busy = false;
+                return;
+            }
+            fd = r->fd;
+        }
+
+        printf("Speaker %x joining %s\n", ip, job.path.c_str());
+        if (!Send_Song(fd, job.song->data(), job.song->size(), loadRate,
+                       nullptr) ||
+            !Send_Play(fd, job.start)) {
+            lock_guard<mutex> lk(speakerLock);
+
+            for (auto &&r : speakers) {
+                if (r.ip == ip && r.fd == fd) {
+                    r.busy = false;
+                    drop(r);
+                }
+            }
+            return;
+        }
+    }
+}
+
+/*
+ * probe -- Sample the offset between our clock and the cluster clock through
+ * this speaker.  Caller holds speakerLock.
+ */
+void
+Conductor::probe(Remote &r)
+{
+    int64_t t0, t1, remote;
+
+    // The connection is in the middle of a song
+    if (r.fd < 0 || r.busy)
+        return;
+
+    t0 = Local_Time();
+    if (!Get_Time(r.fd, &remote)) {
+        drop(r);
+        return;
+    }
+    t1 = Local_Time();
+
+    r.samples.push_back(make_pair(t1 - t0, remote - (t0 + t1) / 2));
+    if (r.samples.size() > CONDUCTOR_SAMPLES)
+        r.samples.pop_front();
+}
+
+void
+Conductor::drop(Remote &r)
+{
+    printf("Speaker %x disconnected\n", r.ip);
+    close(r.fd);
+    r.fd = -1;
+}
+
+/*
+ * estimate -- Clock offset from the probe with the smallest round trip over
+ * all speakers.  Caller holds speakerLock.
+ */
+bool
+Conductor::estimate(int64_t *offset, int64_t *rtt)
+{
+    bool found = false;
+
+    for (auto &&r : speakers) {
+        if (r.fd < 0)
+            continue;
+        for (auto &&s : r.samples) {
+            if (!found || s.first < *rtt) {
+                *rtt = s.first;
+                *offset = s.second;
+                found = true;
+            }
+        }
+    }
+
+    return found;
+}
+
+/*
+ * clusterTime -- Current cluster time.  Caller holds speakerLock.
+ */
+int64_t
+Conductor::clusterTime()
+{
+    int64_t offset, rtt;
+
+    if (!estimate(&offset, &rtt)) {
+        for (auto &&r : speakers) {
+            probe(r);
+        }
+        if (!estimate(&offset, &rtt))
+            return 0;
+    }
+
+    return Local_Time() + offset;
+}
+
+void
+Conductor::playJobs()
+{
+    for (;;) {
+        Job job;
+
+        {
+            unique_lock<mutex> lk(jobLock);
+            while (jobs.empty()) {
+                jobCv.wait(lk);
+            }
+            job = move(jobs.front());
+            jobs.pop_front();
+        }
+
+        play(job);
+    }
+}
+
+/*
+ * play -- Load the job everywhere and start it as soon as the slowest speaker
+ * and the previous track allow.
+ */
+void
+Conductor::play(Job &job)
+{
+    int64_t now;
+    int64_t start;
+    int64_t rtt = 0;
+    int32_t lead = 0;
+    vector<Speaker> targets;
+    vector<uint32_t> loaded;
+    vector<uint32_t> failed;
+    vector<uint32_t> late;
+
+    // speakerd holds SONG_SLOTS songs, load the next once the oldest is over
+    for (;;) {
+        int64_t wait;
+
+        {
+            lock_guard<mutex> lk(speakerLock);
+            if (scheduled.size() < SONG_SLOTS)
+                break;
+            now = clusterTime();
+            wait = scheduled.front().start + scheduled.front().duration - now;
+            if (now == 0 || wait <= 0)
+                break;
+        }
+        usleep(min(wait, (int64_t)1000000));
+    }
+
+    {
+        lock_guard<mutex> lk(speakerLock);
+
+        // Without a clock there is no start time, do not load it anywhere
+        if (!speakers.empty() && clusterTime() == 0) {
+            printf("No reference clock for %s\n", job.path.c_str());
+            return;
+        }
+        for (auto &&r : speakers) {
+            if (r.fd < 0 || r.busy)
+                continue;
+            r.busy = true;
+            targets.push_back(Speaker{ r.ip, r.fd });
+        }
+    }
+
+    if (targets.empty()) {
+        printf("No speakers for %s\n", job.path.c_str());
+        return;
+    }
+
+    if (relay) {
+        relaySong(job, targets, &loaded, &lead, &failed);
+    } else {
+        for (auto &&s : targets) {
+            int32_t l;
+
+            if (Send_Song(s.fd, job.song->data(), job.song->size(), loadRate,
+                          &l)) {
+                loaded.push_back(s.ip);
+                lead = max(lead, l);
+            } else {
+                failed.push_back(s.ip);
+            }
+        }
+    }
+
+    unique_lock<mutex> lk(speakerLock);
+
+    job.seq = jobSeq++;
+    for (auto &&r : speakers) {
+        auto t = find_if(targets.begin(), targets.end(),
+                         [&r](const Speaker &s) {
+                             return s.ip == r.ip && s.fd == r.fd;
+                         });
+
+        if (t == targets.end())
+            continue;
+        r.busy = false;
+        r.next = job.seq + 1;
+        if (find(failed.begin(), failed.end(), r.ip) != failed.end())
+            drop(r);
+    }
+
+    now = clusterTime();
+    if (now == 0) {
+        // Every speaker we had a clock through went away, try it again
+        printf("Lost the reference clock, requeueing %s\n",
+               job.path.c_str());
+        lk.unlock();
+        lock_guard<mutex> jlk(jobLock);
+        jobs.push_front(move(job));
+        return;
+    }
+
+    // The PLAY takes about the best round trip we have seen to each speaker
+    for (auto &&r : speakers) {
+        int64_t best = 0;
+
+        if (r.fd < 0 ||
+            find(loaded.begin(), loaded.end(), r.ip) == loaded.end())
+            continue;
+        for (auto &&s : r.samples) {
+            if (best == 0 || s.first < best)
+                best = s.first;
+        }
+        rtt = max(rtt, best);
+    }
+
+    start = now + lead + rtt + START_MARGIN;
+    if (start < nextStart)
+        start = nextStart;
+
+    for (auto &&r : speakers) {
+        if (r.fd < 0 ||
+            find(loaded.begin(), loaded.end(), r.ip) == loaded.end())
+            continue;
+        if (!Send_Play(r.fd, start))
+            drop(r);
+    }
+    nextStart = start + job.duration;
+
+    printf("Playing %s @ %lld (lead %d us, rtt %lld us)\n", job.path.c_str(),
+           (long long)start, lead, (long long)rtt);
+
+    // speakerd holds SONG_SLOTS songs, remember that many for late joiners
+    job.start = start;
+    while (!scheduled.empty() &&
+           (scheduled.size() >= SONG_SLOTS ||
+            scheduled.front().start + scheduled.front().duration <= now)) {
+        scheduled.pop_front();
+    }
+    scheduled.push_back(move(job));
+
+    // Speakers that connected and caught up while we were sending
+    for (auto &&r : speakers) {
+        if (r.fd >= 0 && !r.busy && r.next <= scheduled.back().seq) {
+            r.busy = true;
+            late.push_back(r.ip);
+        }
+    }
+    lk.unlock();
+
+    for (auto &&ip : late) {
+        catchUp(ip);
+    }
+}
+
+/*
+ * relaySong -- Send the job down a chain of the target speakers in address
+ * order.  If the head fails the next speaker becomes the head and the failed
+ * one is added to failed, speakers further down that fail are skipped by the
+ * chain itself.  Returns the largest lead of the speakers that stored it in
+ * lead.
+ */
+void
+Conductor::relaySong(Job &job, const vector<Speaker> &targets,
+                     vector<uint32_t> *loaded, int32_t *lead,
+                     vector<uint32_t> *failed)
+{
+    vector<Speaker> chain = targets;
+
+    sort(chain.begin(), chain.end(), [](const Speaker &a, const Speaker &b) {
+        return ntohl(a.ip) < ntohl(b.ip);
+    });
+
+    for (size_t i = 0; i < chain.size(); i++) {
+        vector<uint32_t> hops;
+
+        for (size_t j = i + 1; j < chain.size(); j++) {
+            hops.push_back(chain[j].ip);
+        }
+
+        if (Relay_Song(chain[i].fd, hops, job.song->data(), job.song->size(),
+                       loadRate, loaded, lead))
+            return;
+
+        printf("Relay through %x failed\n", chain[i].ip);
+        failed->push_back(chain[i].ip);
+    }
+}
+
+/*
+ * Submit_Job -- Hand a song to a running conductor.
+ *
+ * Returns -1 if no conductor is listening, 0 once the conductor queued the
+ * song and 1 if it rejected it.  Only a socket owned by root or by us is
+ * trusted to be the conductor, anyone else listening there gets nothing.
+ */
+int
+Submit_Job(const char *sockpath, const char *path)
+{
+    int fd;
+    int32_t status = -1;
+    uint32_t len;
+    char full[PATH_MAX];
+    struct sockaddr_un addr;
+    struct stat sb;
+
+    if (lstat(sockpath, &sb) < 0)
+        return -1;
+    if (!S_ISSOCK(sb.st_mode) || (sb.st_uid != 0 && sb.st_uid != geteuid())) {
+        printf("%s: not a conductor socket, playing directly\n", sockpath);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sockpath, sizeof(addr.sun_path) - 1);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (realpath(path, full) == nullptr) {
+        perror("realpath");
+        close(fd);
+        return 1;
+    }
+
+    len = strlen(full);
+    if (!Write_All(fd, &len, sizeof(len)) || !Write_All(fd, full, len) ||
+        !Read_All(fd, &status, sizeof(status))) {
+        close(fd);
+        return 1;
+    }
+
+    close(fd);
+
+    return (status == 0) ? 0 : 1;
+}
+
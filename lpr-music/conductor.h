@@ -0,0 +1,77 @@
+
+#ifndef __CONDUCTOR_H__
+#define __CONDUCTOR_H__
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "speakers.h"
+
+/*
+ * Conductor -- Long running lpr-music that keeps warm connections to all
+ * speakers and plays jobs submitted over a local socket.
+ */
+class Conductor
+{
+public:
+    Conductor(const char *registry, const char *sockpath, int port,
+              int syncPort, int timeoutMs, int64_t loadRate, bool relay);
+    ~Conductor();
+    int run();
+private:
+    struct Remote
+    {
+        uint32_t ip;
+        int fd;
+        std::deque<std::pair<int64_t, int64_t>> samples; // (RTT, Offset)
+        bool busy;          // A song is being sent, outside speakerLock
+        uint64_t next;      // Sequence of the first job it has not been sent
+    };
+    struct Job
+    {
+        std::string path;
+        std::shared_ptr<std::vector<char>> song;
+        int64_t duration;
+        int64_t start;      // Cluster time, once scheduled
+        uint64_t seq;       // Order of scheduling
+    };
+    void maintain();
+    void refresh();
+    void probe(Remote &r);
+    void drop(Remote &r);
+    bool estimate(int64_t *offset, int64_t *rtt);
+    int64_t clusterTime();
+    void playJobs();
+    void play(Job &job);
+    void relaySong(Job &job, const std::vector<Speaker> &targets,
+                   std::vector<uint32_t> *loaded, int32_t *lead,
+                   std::vector<uint32_t> *failed);
+    void catchUp(uint32_t ip);
+    void receive(int client);
+    const char *registry;
+    const char *sockpath;
+    int port;
+    int syncPort;
+    int timeoutMs;
+    int64_t loadRate;   // LOAD pacing (bytes/s), 0 for none
+    bool relay;         // Send songs once down a chain of speakers
+    std::mutex speakerLock;
+    std::vector<Remote> speakers;
+    std::mutex jobLock;
+    std::condition_variable jobCv;
+    std::deque<Job> jobs;
+    int64_t nextStart;
+    uint64_t jobSeq;
+    std::deque<Job> scheduled;  // Playing or about to, for late joiners
+};
+
+int Submit_Job(const char *sockpath, const char *path);
+
+#endif /* __CONDUCTOR_H__ */
+
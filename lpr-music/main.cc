@@ -1,7 +1,9 @@
 
+#include <algorithm>
 #include <iostream>
 #include <fcntl.h>
 #include <string>
+#include <string.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -13,112 +15,212 @@
 
 #include "../speakerd/printer.h"
 #include "../speakerd/timesync.h"
+#include "cache.h"
+#include "conductor.h"
+#include "speakers.h"
 
 using namespace std;
 
+static void
+Usage(const char *prog)
+{
+    printf("Usage: %s [-r REGISTRY] [-s SOCKET] [-t CONNECT_TIMEOUT_MS]\n"
+           "          [-p PORT] [-P SYNC_PORT] [-B LOAD_KBPS] [-R] AACFILE\n", prog);
+    printf("       %s -d [-r REGISTRY] [-s SOCKET] [-t CONNECT_TIMEOUT_MS]\n"
+           "          [-p PORT] [-P SYNC_PORT] [-B LOAD_KBPS] [-R]\n", prog);
+    printf("       %s -c pause|resume|seek=SECONDS [-r REGISTRY]\n"
+           "          [-t CONNECT_TIMEOUT_MS] [-p PORT] [-P SYNC_PORT]\n", prog);
+    printf("       %s -T [-C CACHEDIR] [-M CACHE_MB] [...] [FILE]\n", prog);
+    printf("Options:\n");
+    printf("    -d      Run as the conductor daemon\n");
+    printf("    -s      Conductor socket (default: %s)\n",
+           MUSICPRINTER_CONDUCTOR);
+    printf("    -p      speakerd command port (default: %d)\n",
+           MUSICPRINTER_PORT);
+    printf("    -P      Time sync port used for discovery (default: %d)\n",
+           TIMESYNC_PORT);
+    printf("    -B      Song transfer rate in kB/s, 0 for no limit "
+           "(default: %d)\n", LOAD_RATE / 1000);
+    printf("    -R      Send the song once and let the speakers relay it,\n"
+           "            use beyond a few speakers\n");
+    printf("    -c      Pause, resume or seek the song playing everywhere\n");
+    printf("    -T      Transcode FILE, or stdin, to AAC through the cache first\n");
+    printf("    -C      Transcode cache (default: %s)\n", TRANSCODE_CACHE);
+    printf("    -M      Transcode cache size in MB (default: %d)\n",
+           TRANSCODE_CACHE_MB);
+}
+
 /*
- * Discover a speaker and return the IP address as a string.
+ * Control_Speakers -- Apply a PAUSE, RESUME or SEEK on every speaker at the
+ * same cluster time, CONTROL_LEAD from now.
  */
-TSPkt
-Discover_Speaker()
+static int
+Control_Speakers(const char *action, const char *registry, int port,
+                 int syncPort, int timeoutMs)
 {
-    int fd;
-    int status;
-    struct sockaddr_in addr;
-    int reuseaddr = 1;
-    int broadcast = 1;
-
-    // Create a network socket
-    fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (fd < 0) {
-        perror("socket");
-        abort();
+    vector<Speaker> speakers;
+    int cmd;
+    int arg = 0;
+    int64_t ts;
+    bool timed = false;
+
+    if (strcmp(action, "pause") == 0) {
+        cmd = MUSICPRINTER_PAUSE;
+    } else if (strcmp(action, "resume") == 0) {
+        cmd = MUSICPRINTER_RESUME;
+    } else if (strncmp(action, "seek=", 5) == 0) {
+        cmd = MUSICPRINTER_SEEK;
+        arg = (int)(strtod(action + 5, nullptr) * 1000);
+    } else {
+        printf("Unknown control %s\n", action);
+        return 1;
     }
 
-    /*
-     * Ensure that we can reopen the address and port without the default 
-     * timeout (usually 120 seconds) that blocks reusing addresses and ports 
-     * immediately.
-     */
-    status = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
-                        &reuseaddr, sizeof(reuseaddr));
-    if (status < 0) {
-        perror("setsockopt");
-        abort();
+    speakers = Connect_Speakers(Find_Speakers(registry, syncPort), port,
+                                timeoutMs);
+    if (speakers.empty()) {
+        printf("No speakers available\n");
+        return 1;
     }
 
-    status = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
-                        &reuseaddr, sizeof(reuseaddr));
-    if (status < 0) {
-        perror("setsockopt");
-        abort();
+    for (auto &&s : speakers) {
+        if (Get_Time(s.fd, &ts)) {
+            timed = true;
+            break;
+        }
     }
-
-    // Make this a broadcast socket
-    status = setsockopt(fd, SOL_SOCKET, SO_BROADCAST,
-                          &broadcast, sizeof(broadcast));
-    if (status < 0) {
-        perror("setsockopt");
-        abort();
+    if (!timed) {
+        printf("No speaker answered GETTIME\n");
+        return 1;
     }
+    ts += CONTROL_LEAD;
 
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(TIMESYNC_PORT);
-
-    // Bind to the address/port we want to listen to
-    status = ::bind(fd, (struct sockaddr *)&addr, sizeof(addr));
-    if (status < 0) {
-        perror("bind");
-        abort();
+    for (auto &&s : speakers) {
+        if (!Send_Control(s.fd, cmd, arg, ts))
+            printf("%s to %x failed\n", action, s.ip);
+        close(s.fd);
     }
 
-    while (1) {
-        TSPkt pkt;
-        ssize_t bufLen = sizeof(pkt);
-        struct sockaddr_in srcAddr;
-        socklen_t srcAddrLen = sizeof(srcAddr);
-        char srcAddrStr[INET_ADDRSTRLEN];
-
-        // Receive a single packet
-        bufLen = recvfrom(fd, (void *)&pkt, (size_t)bufLen, 0,
-                       (struct sockaddr *)&srcAddr, &srcAddrLen);
-        if (bufLen < 0) {
-            perror("recvfrom");
-            continue;
-        }
-        if (bufLen != sizeof(pkt)) {
-            cout << "Packet recieved with the wrong size!" << endl;
-            continue;
-        }
-
-        if (pkt.magic != TIMESYNC_MAGIC) {
-            cout << "Received a corrupted timesync packet!" << endl;
-            continue;
-        }
-
-        inet_ntop(AF_INET, &srcAddr.sin_addr, srcAddrStr, INET_ADDRSTRLEN);
-        printf("Received from %s\n", srcAddrStr);
-
-        return pkt;
-    }
+    printf("%s @ %lld\n", action, (long long)ts);
+    return 0;
 }
 
 int
-main(int argc, const char *argv[])
+main(int argc, char *argv[])
 {
 
     int fd;
+    int ch;
     int status;
     struct stat sb;
+    const char *registry = MUSICPRINTER_REGISTRY;
+    const char *sockpath = MUSICPRINTER_CONDUCTOR;
+    int timeoutMs = 500;
+    int port = MUSICPRINTER_PORT;
+    int syncPort = TIMESYNC_PORT;
+    int64_t loadRate = LOAD_RATE;
+    bool conduct = false;
+    bool relay = false;
+    const char *action = nullptr;
+    bool transcode = false;
+    const char *cacheDir = TRANSCODE_CACHE;
+    int64_t cacheMb = TRANSCODE_CACHE_MB;
+    const char *song;
+    string cached;
+
+    while ((ch = getopt(argc, argv, "B:c:C:dM:p:P:r:Rs:t:Th")) != -1) {
+        switch (ch) {
+            case 'B':
+                loadRate = strtoll(optarg, nullptr, 0) * 1000;
+                break;
+            case 'c':
+                action = optarg;
+                break;
+            case 'C':
+                cacheDir = optarg;
+                break;
+            case 'd':
+                conduct = true;
+                break;
+            case 'M':
+                cacheMb = strtoll(optarg, nullptr, 0);
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'P':
+                syncPort = atoi(optarg);
+                break;
+            case 'r':
+                registry = optarg;
+                break;
+            case 'R':
+                relay = true;
+                break;
+            case 's':
+                sockpath = optarg;
+                break;
+            case 't':
+                timeoutMs = atoi(optarg);
+                break;
+            case 'T':
+                transcode = true;
+                break;
+            case 'h':
+            default:
+                Usage(argv[0]);
+                return 1;
+        }
+    }
+    argc -= optind;
+    argv += optind;
 
-    if (argc != 2){
+    if (conduct) {
+        Conductor conductor(registry, sockpath, port, syncPort, timeoutMs,
+                            loadRate, relay);
+
+        return conductor.run();
+    }
+
+    if (action != nullptr)
+        return Control_Speakers(action, registry, port, syncPort, timeoutMs);
+
+    TranscodeCache cache(cacheDir, cacheMb * 1024 * 1024);
+
+    if (transcode && argc == 0) {
+        // Print filter, the job arrives on stdin
+        if (!cache.transcode(STDIN_FILENO, &cached))
+            return 1;
+        song = cached.c_str();
+    } else if (transcode && argc == 1) {
+        fd = open(argv[0], O_RDONLY);
+        if (fd < 0) {
+            perror("open");
+            return 1;
+        }
+        status = cache.transcode(fd, &cached);
+        close(fd);
+        if (!status)
+            return 1;
+        song = cached.c_str();
+    } else if (argc == 1) {
+        song = argv[0];
+    } else {
         printf("Missing arguments");
         return 1;
     }
 
-    if (lstat(argv[1],&sb) < 0){
+    // Hand the job to the conductor if one is running
+    status = Submit_Job(sockpath, song);
+    if (status >= 0) {
+        if (status == 0)
+            printf("Queued on conductor\n");
+        else
+            printf("Conductor rejected %s\n", song);
+        return status;
+    }
+
+    if (lstat(song,&sb) < 0){
         perror("lstat error");
         return 1;
     }
@@ -126,7 +228,7 @@ main(int argc, const char *argv[])
     int len = sb.st_size;
     char *buffer = new char[len];
     
-    fd = open(argv[1], O_RDONLY);
+    fd = open(song, O_RDONLY);
     if (fd < 0){
         perror("read error");
         return 1;
@@ -152,132 +254,110 @@ main(int argc, const char *argv[])
     }while (ttlbytesread < ttlfilesize);
     
     printf("%d bytes buffered\n", ttlbytesread);
+    close(fd);
 
-    int speakers[TIMESYNC_MACHINES];
-    TSPkt pkt;
+    // Buffered, the rendition may be evicted now
+    cache.release();
 
-    pkt = Discover_Speaker();
-    printf("Discovered\n");
-    // Read stdin and forward to all speakers
-    for (int i = 0; i < TIMESYNC_MACHINES; i++) {
-        int status;
+    vector<Speaker> speakers;
 
-        if (pkt.machines[i].ip == 0) {
-            speakers[i] = -1;
-            continue;
-        }
+    speakers = Connect_Speakers(Find_Speakers(registry, syncPort), port,
+                                timeoutMs);
+    if (speakers.empty()) {
+        printf("No speakers available\n");
+        return 1;
+    }
+    printf("Connected to all speakers\n");
 
-        speakers[i] = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (speakers[i] < 0) {
-            perror("socket");
-            return 1;
+    vector<uint32_t> loaded;
+    int32_t lead = 0;
+
+    if (relay) {
+        // One copy down a chain in address order, the next head on failure
+        sort(speakers.begin(), speakers.end(),
+             [](const Speaker &a, const Speaker &b) {
+                 return ntohl(a.ip) < ntohl(b.ip);
+             });
+        for (size_t i = 0; i < speakers.size(); i++) {
+            vector<uint32_t> hops;
+
+            for (size_t j = i + 1; j < speakers.size(); j++) {
+                hops.push_back(speakers[j].ip);
+            }
+            if (Relay_Song(speakers[i].fd, hops, buffer, ttlfilesize,
+                           loadRate, &loaded, &lead))
+                break;
+            printf("Relay through %x failed\n", speakers[i].ip);
         }
-
-        struct sockaddr_in addr;
-        memset(&addr, 0, sizeof(addr));
-        addr.sin_family = AF_INET;
-        addr.sin_addr.s_addr = pkt.machines[i].ip;
-        addr.sin_port = htons(MUSICPRINTER_PORT);
-
-        printf("Connecting %x\n", addr.sin_addr.s_addr);
-        status = connect(speakers[i], (struct sockaddr *)&addr, sizeof(addr));
-        if (status < 0) {
-            perror("connect");
-            close(speakers[i]);
-            speakers[i] = -1;
+    } else {
+        // Send everyone the song
+        for (auto &&s : speakers){
+            int32_t l;
+
+            printf("Syncing..\n");
+
+            if (!Send_Song(s.fd, buffer, ttlfilesize, loadRate, &l)) {
+                printf("song to %x failed\n", s.ip);
+                continue;
+            }
+            loaded.push_back(s.ip);
+            lead = max(lead, l);
+            printf("song done\n");
         }
     }
-    printf("Connected to all speakers\n");
+    if (loaded.empty()) {
+        printf("No speaker loaded the song\n");
+        return 1;
+    }
 
-    // Send everyone the song
-    for (int i = 0; i < TIMESYNC_MACHINES; i++){
-        int magic = 0xAA55AA55;
-        int cmd = MUSICPRINTER_LOAD;
-        int arg = ttlfilesize;
+    /*
+     * Read the reference clock through every speaker that has the song.  The
+     * shortest round trip gives the best offset, the longest bounds how long
+     * a PLAY takes to arrive.
+     */
+    int64_t offset = 0;
+    int64_t best = -1;
+    int64_t rtt = 0;
 
-        printf("Syncing..\n");
-        if (speakers[i] < 0){
-            continue;
-        }
+    for (auto &&s : speakers) {
+        int64_t t0, t1, remote;
 
-        status = write(speakers[i], (char *)&magic, sizeof(int));
-        if (status < 0) {
-            perror("write cmd 1");
-            continue;
-        }
-        if (status != 4) {
-            printf("write cmd 1 wrong len\n");
-        }
-        status = write(speakers[i], (char *)&cmd, sizeof(int));
-        if (status < 0) {
-            perror("write cmd 1");
+        if (find(loaded.begin(), loaded.end(), s.ip) == loaded.end())
             continue;
-        }
-        if (status != 4) {
-            printf("write cmd 1 wrong len\n");
-        }
-        status = write(speakers[i], (char *)&arg, sizeof(int));
-        if (status < 0) {
-            perror("write cmd 1");
-            continue;
-        }
-        if (status != 4) {
-            printf("write cmd 1 wrong len\n");
-        }
 
-        status = write(speakers[i], buffer, arg); // or use ttlfilesize instead
-        if (status < 0) {
-            perror("write cmd 1");
+        t0 = Local_Time();
+        if (!Get_Time(s.fd, &remote)) {
+            printf("reference clock read from %x failed\n", s.ip);
             continue;
         }
-        if (status != arg) {
-            printf("song len wrong?\n");
-        }
-        printf("song done\n");
-    }
-
-        int64_t ts;
-
-    // Read the reference clock
-    {
-        int magic = 0xAA55AA55;
-        int cmd = MUSICPRINTER_GETTIME;
-        int arg = 0;
+        t1 = Local_Time();
 
-        write(speakers[0], (char *)&magic, sizeof(int));
-        write(speakers[0], (char *)&cmd, sizeof(int));
-        write(speakers[0], (char *)&arg, sizeof(int));
-
-        status = read(speakers[0], (char *)&ts, sizeof(int64_t));
-        if (status < 0) {
-            perror("reference clock read");
-            return 1;
+        if (best < 0 || t1 - t0 < best) {
+            best = t1 - t0;
+            offset = remote - (t0 + t1) / 2;
         }
+        rtt = max(rtt, t1 - t0);
+    }
+    if (best < 0) {
+        printf("No speaker answered GETTIME\n");
+        return 1;
     }
 
-    // Add 5 seconds to reference clock
-    ts += 5*1000*1000;
+    // As early as the slowest speaker allows
+    int64_t ts = Local_Time() + offset + lead + rtt + START_MARGIN;
 
     // Tell everyone the start time
     cout << "playing.." << endl;
-    for (int i = 0; i < TIMESYNC_MACHINES; i++){
-        int magic = 0xAA55AA55;
-        int cmd = MUSICPRINTER_PLAY;
-        int arg = 0;
-
-        if (speakers[i] < 0){
-            continue;
-        }
-
-        write(speakers[i], (char *)&magic, sizeof(int));
-        write(speakers[i], (char *)&cmd, sizeof(int));
-        write(speakers[i], &arg, sizeof(int));
-        write(speakers[i], &ts, sizeof(int64_t));
+    for (auto &&s : speakers){
+        if (find(loaded.begin(), loaded.end(), s.ip) != loaded.end() &&
+            !Send_Play(s.fd, ts))
+            printf("PLAY to %x failed\n", s.ip);
 
-        close(speakers[i]);
+        close(s.fd);
     }
 
-    printf("Starting @ %ld\n", ts);
+    printf("Starting @ %lld (lead %d us, rtt %lld us)\n", (long long)ts,
+           lead, (long long)rtt);
     printf("Done.\n");
 }
 
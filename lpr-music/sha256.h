@@ -0,0 +1,30 @@
+
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#define SHA256_DIGEST   32
+
+/*
+ * Sha256 -- Incremental SHA-256 (FIPS 180-4).
+ */
+class Sha256
+{
+public:
+    Sha256();
+    void update(const void *buf, size_t len);
+    void final(uint8_t digest[SHA256_DIGEST]);
+    std::string hex();
+private:
+    void block(const uint8_t *p);
+    uint32_t state[8];
+    uint64_t bytes;         // Hashed so far
+    uint8_t buf[64];        // Partial block
+};
+
+#endif /* __SHA256_H__ */
+
@@ -0,0 +1,543 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include "../speakerd/printer.h"
+#include "../speakerd/timesync.h"
+#include "speakers.h"
+
+using namespace std;
+
+/*
+ * Discover_Speaker -- Wait up to DISCOVER_TIMEOUT ms for a timesync
+ * announcement.  Returns false if no speaker announced itself in time.
+ */
+bool
+Discover_Speaker(int syncPort, TSPkt *pkt)
+{
+    int fd;
+    int status;
+    struct sockaddr_in addr;
+    int reuseaddr = 1;
+    int broadcast = 1;
+    int64_t deadline;
+    bool found = false;
+
+    // Create a network socket
+    fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd < 0) {
+        perror("socket");
+        return false;
+    }
+
+    /*
+     * Ensure that we can reopen the address and port without the default 
+     * timeout (usually 120 seconds) that blocks reusing addresses and ports 
+     * immediately.
+     */
+    status = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+                        &reuseaddr, sizeof(reuseaddr));
+    if (status < 0) {
+        perror("setsockopt");
+        goto done;
+    }
+
+    status = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+                        &reuseaddr, sizeof(reuseaddr));
+    if (status < 0) {
+        perror("setsockopt");
+        goto done;
+    }
+
+    // Make this a broadcast socket
+    status = setsockopt(fd, SOL_SOCKET, SO_BROADCAST,
+                          &broadcast, sizeof(broadcast));
+    if (status < 0) {
+        perror("setsockopt");
+        goto done;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(syncPort);
+
+    // Bind to the address/port we want to listen to
+    status = ::bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (status < 0) {
+        perror("bind");
+        goto done;
+    }
+
+    deadline = Local_Time() + (int64_t)DISCOVER_TIMEOUT * 1000;
+    while (!found) {
+        ssize_t bufLen = sizeof(*pkt);
+        struct sockaddr_in srcAddr;
+        socklen_t srcAddrLen = sizeof(srcAddr);
+        char srcAddrStr[INET_ADDRSTRLEN];
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int64_t left = deadline - Local_Time();
+
+        memset(pkt, 0, sizeof(*pkt));
+
+        if (left <= 0 || poll(&pfd, 1, (int)((left + 999) / 1000)) == 0) {
+            printf("No speaker announced itself\n");
+            break;
+        }
+
+        // Receive a single packet
+        bufLen = recvfrom(fd, (void *)pkt, (size_t)bufLen, MSG_DONTWAIT,
+                       (struct sockaddr *)&srcAddr, &srcAddrLen);
+        if (bufLen < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                perror("recvfrom");
+            continue;
+        }
+        if (bufLen < (ssize_t)TSPKT_MINLEN) {
+            cout << "Packet recieved with the wrong size!" << endl;
+            continue;
+        }
+
+        if (pkt->magic != TIMESYNC_MAGIC) {
+            cout << "Received a corrupted timesync packet!" << endl;
+            continue;
+        }
+
+        inet_ntop(AF_INET, &srcAddr.sin_addr, srcAddrStr, INET_ADDRSTRLEN);
+        printf("Received from %s\n", srcAddrStr);
+
+        found = true;
+    }
+
+done:
+    close(fd);
+    return found;
+}
+
+/*
+ * Load_Registry -- Read the live speaker list maintained by a local speakerd.
+ *
+ * Returns false if there is no registry or it is stale, which means speakerd
+ * is not running on this host.  Speakers whose age (plus the age of the file)
+ * exceeds the liveness window are skipped.  Only a plain file owned by root
+ * or by us that nobody else can write is trusted.
+ */
+bool
+Load_Registry(const char *path, vector<uint32_t> &ips)
+{
+    FILE *f;
+    struct stat sb;
+    char line[128];
+    int64_t fileAge;
+
+    if (path == nullptr || path[0] == '\0')
+        return false;
+
+    if (lstat(path, &sb) < 0)
+        return false;
+
+    // Anyone who could write it could point us at their own speakers
+    if (!S_ISREG(sb.st_mode) || (sb.st_mode & (S_IWGRP | S_IWOTH)) != 0 ||
+        (sb.st_uid != 0 && sb.st_uid != geteuid())) {
+        printf("%s: not a registry written by speakerd\n", path);
+        return false;
+    }
+
+    fileAge = ((int64_t)time(nullptr) - sb.st_mtime) * 1000;
+    if (fileAge * 1000 >= TIMESYNC_LIVENESS)
+        return false;
+
+    f = fopen(path, "r");
+    if (f == nullptr) {
+        perror("fopen registry");
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), f) != nullptr) {
+        char ipStr[INET_ADDRSTRLEN];
+        long long age;
+        uint32_t ip;
+
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%15s %lld", ipStr, &age) != 2)
+            continue;
+        if (inet_pton(AF_INET, ipStr, &ip) != 1)
+            continue;
+        if ((age + fileAge) * 1000 >= TIMESYNC_LIVENESS)
+            continue;
+
+        ips.push_back(ip);
+    }
+
+    fclose(f);
+
+    return !ips.empty();
+}
+
+/*
+ * Find_Speakers -- List the live speakers, from the registry when a local
+ * speakerd keeps one, otherwise by waiting for a timesync announcement.
+ * Empty if neither turns up a speaker.
+ */
+vector<uint32_t>
+Find_Speakers(const char *registry, int syncPort)
+{
+    vector<uint32_t> ips;
+    TSPkt pkt;
+
+    if (Load_Registry(registry, ips)) {
+        return ips;
+    }
+
+    if (!Discover_Speaker(syncPort, &pkt))
+        return ips;
+    for (int i = 0; i < TIMESYNC_MACHINES; i++) {
+        if (pkt.machines[i].ip == 0)
+            continue;
+        if ((int64_t)pkt.machines[i].age * 1000 >= TIMESYNC_LIVENESS)
+            continue;
+        ips.push_back(pkt.machines[i].ip);
+    }
+
+    return ips;
+}
+
+/*
+ * Connect_Speakers -- Open control connections to all speakers at once.
+ *
+ * Every connect is started non-blocking and then waited on together, so the
+ * whole setup takes one round trip and a dead speaker costs at most timeoutMs
+ * instead of a full TCP connect timeout per entry.  Returns the speakers that
+ * connected, with blocking sockets.
+ */
+vector<Speaker>
+Connect_Speakers(const vector<uint32_t> &ips, int port, int timeoutMs)
+{
+    vector<Speaker> pending;
+    vector<Speaker> connected;
+    struct timeval start, now;
+
+    for (auto &&ip : ips) {
+        int fd;
+        int status;
+        struct sockaddr_in addr;
+
+        fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (fd < 0) {
+            perror("socket");
+            continue;
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = ip;
+        addr.sin_port = htons(port);
+
+        printf("Connecting %x\n", addr.sin_addr.s_addr);
+        status = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+        if (status < 0 && errno != EINPROGRESS) {
+            perror("connect");
+            close(fd);
+            continue;
+        }
+
+        pending.push_back(Speaker{ ip, fd });
+    }
+
+    gettimeofday(&start, nullptr);
+    while (!pending.empty()) {
+        vector<struct pollfd> pfds;
+        int elapsed;
+        int status;
+
+        gettimeofday(&now, nullptr);
+        elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+                  (now.tv_usec - start.tv_usec) / 1000;
+        if (elapsed >= timeoutMs)
+            break;
+
+        for (auto &&s : pending) {
+            pfds.push_back(pollfd{ s.fd, POLLOUT, 0 });
+        }
+
+        status = poll(pfds.data(), pfds.size(), timeoutMs - elapsed);
+        if (status < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        vector<Speaker> still;
+        for (size_t i = 0; i < pending.size(); i++) {
+            int err = 0;
+            socklen_t errlen = sizeof(err);
+            Speaker &s = pending[i];
+
+            if (pfds[i].revents == 0) {
+                still.push_back(s);
+                continue;
+            }
+
+            getsockopt(s.fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+            if (err != 0) {
+                printf("connect %x: %s\n", s.ip, strerror(err));
+                close(s.fd);
+                continue;
+            }
+
+            fcntl(s.fd, F_SETFL, fcntl(s.fd, F_GETFL) & ~O_NONBLOCK);
+            connected.push_back(s);
+        }
+        pending.swap(still);
+    }
+
+    for (auto &&s : pending) {
+        printf("connect %x: timed out\n", s.ip);
+        close(s.fd);
+    }
+
+    return connected;
+}
+
+/*
+ * Local_Time -- Local time in microseconds.
+ */
+int64_t
+Local_Time()
+{
+    struct timeval tp;
+
+    gettimeofday(&tp, nullptr);
+
+    return (int64_t)tp.tv_sec * 1000000 + tp.tv_usec;
+}
+
+bool
+Write_All(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+
+    while (len > 0) {
+        ssize_t status = write(fd, p, len);
+        if (status < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            return false;
+        }
+        p += status;
+        len -= status;
+    }
+
+    return true;
+}
+
+bool
+Read_All(int fd, void *buf, size_t len)
+{
+    char *p = (char *)buf;
+
+    while (len > 0) {
+        ssize_t status = read(fd, p, len);
+        if (status < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            return false;
+        }
+        if (status == 0) {
+            printf("Connection closed\n");
+            return false;
+        }
+        p += status;
+        len -= status;
+    }
+
+    return true;
+}
+
+/*
+ * Send_Command -- Send the command header: magic, command and argument.
+ */
+bool
+Send_Command(int fd, int cmd, int arg)
+{
+    int hdr[3] = { (int)MUSICPRINTER_MAGIC, cmd, arg };
+
+    return Write_All(fd, hdr, sizeof(hdr));
+}
+
+/*
+ * Set_Tos -- Mark what is sent on fd from now on.  A song goes out as DSCP CS1
+ * so it yields to time sync traffic, the rest of the connection stays best
+ * effort.  Writes are buffered, so the mark stays until the speaker has
+ * acknowledged the song.
+ */
+static void
+Set_Tos(int fd, int tos)
+{
+    if (setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0)
+        perror("setsockopt IP_TOS");
+}
+
+/*
+ * Send_Paced -- Write a song paced to rate bytes per second, 0 for no limit.
+ */
+static bool
+Send_Paced(int fd, const char *buf, int len, int64_t rate)
+{
+    int64_t start;
+    int sent = 0;
+    bool ok = true;
+
+    start = Local_Time();
+    while (ok && sent < len) {
+        int n = min(len - sent, LOAD_BURST);
+
+        if (rate > 0) {
+            int64_t due = start + (int64_t)sent * 1000000 / rate;
+            int64_t now = Local_Time();
+
+            if (due > now)
+                usleep(due - now);
+        }
+
+        ok = Write_All(fd, buf + sent, n);
+        sent += n;
+    }
+
+    return ok;
+}
+
+/*
+ * Send_Song -- LOAD a song, paced to rate bytes per second.  Succeeds once the
+ * speaker acknowledges it stored the song, its lead is returned in lead if
+ * not nullptr.
+ */
+bool
+Send_Song(int fd, const char *buf, int len, int64_t rate, int32_t *lead)
+{
+    struct timeval tv = { 0, 0 };
+    struct timeval old;
+    socklen_t oldlen = sizeof(old);
+    int32_t ack;
+    bool ok;
+
+    Set_Tos(fd, MUSICPRINTER_TOS_BULK);
+    ok = Send_Command(fd, MUSICPRINTER_LOAD, len) &&
+         Send_Paced(fd, buf, len, rate);
+    if (ok) {
+        // The speaker only takes a song once a slot is free, however long
+        getsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &old, &oldlen);
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        ok = Read_All(fd, &ack, sizeof(ack));
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &old, sizeof(old));
+    }
+    Set_Tos(fd, 0);
+
+    if (!ok || ack < 0)
+        return false;
+
+    if (lead != nullptr)
+        *lead = ack;
+    return true;
+}
+
+/*
+ * Relay_Song -- Send a song once, to the speaker on fd, which passes it down
+ * the chain of hops behind it (see MUSICPRINTER_RELAY).  Returns the speakers
+ * that stored the song in loaded and the largest lead among them in lead.
+ */
+bool
+Relay_Song(int fd, const vector<uint32_t> &hops, const char *buf, int len,
+           int64_t rate, vector<uint32_t> *loaded, int32_t *lead)
+{
+    uint32_t count = hops.size();
+    struct timeval tv = { RELAY_TIMEOUT, 0 };
+    struct timeval old;
+    socklen_t oldlen = sizeof(old);
+    bool ok;
+
+    Set_Tos(fd, MUSICPRINTER_TOS_BULK);
+    if (!Send_Command(fd, MUSICPRINTER_RELAY, len) ||
+        !Write_All(fd, &count, sizeof(count)) ||
+        !Write_All(fd, hops.data(), count * sizeof(uint32_t)) ||
+        !Send_Paced(fd, buf, len, rate)) {
+        Set_Tos(fd, 0);
+        return false;
+    }
+
+    // The reply only comes once the whole chain has the song
+    getsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &old, &oldlen);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    ok = Read_All(fd, &count, sizeof(count)) &&
+         count <= MUSICPRINTER_RELAY_MAXHOPS + 1;
+    if (ok) {
+        vector<uint32_t> ips(count);
+
+        ok = Read_All(fd, ips.data(), count * sizeof(uint32_t)) &&
+             Read_All(fd, lead, sizeof(*lead));
+        if (ok)
+            loaded->insert(loaded->end(), ips.begin(), ips.end());
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &old, sizeof(old));
+    Set_Tos(fd, 0);
+
+    if (ok)
+        printf("Relay stored on %u of %zu speakers\n", count,
+               hops.size() + 1);
+
+    return ok;
+}
+
+/*
+ * Get_Time -- Read the cluster reference clock from a speaker.
+ */
+bool
+Get_Time(int fd, int64_t *ts)
+{
+    return Send_Command(fd, MUSICPRINTER_GETTIME, 0) &&
+           Read_All(fd, ts, sizeof(*ts));
+}
+
+/*
+ * Send_Play -- Start the loaded song at ts (cluster time).
+ */
+bool
+Send_Play(int fd, int64_t ts)
+{
+    return Send_Command(fd, MUSICPRINTER_PLAY, 0) &&
+           Write_All(fd, &ts, sizeof(ts));
+}
+
+/*
+ * Send_Control -- PAUSE, RESUME or SEEK the song playing at ts (cluster
+ * time).  arg is the SEEK position in ms.
+ */
+bool
+Send_Control(int fd, int cmd, int arg, int64_t ts)
+{
+    return Send_Command(fd, cmd, arg) && Write_All(fd, &ts, sizeof(ts));
+}
+
@@ -0,0 +1,63 @@
+
+#ifndef __SPEAKERS_H__
+#define __SPEAKERS_H__
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "../speakerd/timesync.h"
+
+/*
+ * A song starts as soon as the slowest speaker can make it: the largest lead
+ * the speakers acknowledged LOAD with, plus the longest round trip to them
+ * for the PLAY to arrive, plus START_MARGIN.
+ */
+#define START_MARGIN    (20 * 1000)
+
+// Time between asking for the reference clock and a PAUSE, RESUME or SEEK
+#define CONTROL_LEAD    (500 * 1000)
+
+/*
+ * Songs are sent at no more than LOAD_RATE bytes per second in LOAD_BURST
+ * sized writes, a full speed transfer queues in front of time sync packets.
+ * Speakers are sent their copies one after another, so LOAD_RATE bounds the
+ * whole upload and distribution takes speakers * size / LOAD_RATE.  Beyond a
+ * few speakers relay (-R) instead, which takes size / LOAD_RATE.
+ */
+#define LOAD_RATE   (4 * 1000 * 1000)
+#define LOAD_BURST  (16 * 1024)
+
+// Time to wait for a timesync announcement without a registry (ms)
+#define DISCOVER_TIMEOUT    3000
+
+// Seconds to wait for a relay chain to report which speakers stored a song
+#define RELAY_TIMEOUT   30
+
+struct Speaker
+{
+    uint32_t ip;    // IP Address (network order)
+    int fd;         // Control connection
+};
+
+bool Discover_Speaker(int syncPort, TSPkt *pkt);
+bool Load_Registry(const char *path, std::vector<uint32_t> &ips);
+std::vector<uint32_t> Find_Speakers(const char *registry, int syncPort);
+std::vector<Speaker> Connect_Speakers(const std::vector<uint32_t> &ips,
+                                      int port, int timeoutMs);
+
+int64_t Local_Time();
+bool Write_All(int fd, const void *buf, size_t len);
+bool Read_All(int fd, void *buf, size_t len);
+bool Send_Command(int fd, int cmd, int arg);
+bool Send_Song(int fd, const char *buf, int len, int64_t rate,
+               int32_t *lead);
+bool Relay_Song(int fd, const std::vector<uint32_t> &hops, const char *buf,
+                int len, int64_t rate, std::vector<uint32_t> *loaded,
+                int32_t *lead);
+bool Get_Time(int fd, int64_t *ts);
+bool Send_Play(int fd, int64_t ts);
+bool Send_Control(int fd, int cmd, int arg, int64_t ts);
+
+#endif /* __SPEAKERS_H__ */
+
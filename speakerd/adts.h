@@ -0,0 +1,182 @@
+
+#ifndef __ADTS_H__
+#define __ADTS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+/*
+ * Audio Data Transport Stream (ADTS) framing for AAC.
+ *
+ * Every frame starts with a 7 byte header (9 with CRC) that carries the
+ * syncword, the sampling frequency index, the frame length in bytes and the
+ * number of raw data blocks.  Each block decodes to 1024 samples per channel.
+ */
+
+#define ADTS_HEADER_LEN         7
+#define ADTS_SAMPLES_PER_BLOCK  1024
+#define ADTS_INDEX_STRIDE       16      // Frames per index entry
+
+struct ADTSFrame
+{
+    uint32_t len;       // Frame length including the header
+    uint32_t samples;   // Samples per channel
+    uint32_t rate;      // Sampling frequency (Hz)
+};
+
+/*
+ * ADTS_Parse -- Decode the header at p.  Returns false if p does not start a
+ * valid frame.
+ */
+static inline bool
+ADTS_Parse(const unsigned char *p, size_t avail, ADTSFrame *f)
+{
+    static const uint32_t rates[16] = {
+        96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050,
+        16000, 12000, 11025, 8000, 7350, 0, 0, 0,
+    };
+
+    if (avail < ADTS_HEADER_LEN)
+        return false;
+
+    // 12 bit syncword and layer 00
+    if (p[0] != 0xFF || (p[1] & 0xF6) != 0xF0)
+        return false;
+
+    f->rate = rates[(p[2] >> 2) & 0xF];
+    f->len = ((uint32_t)(p[3] & 0x3) << 11) | ((uint32_t)p[4] << 3) |
+             (p[5] >> 5);
+    f->samples = ((p[6] & 0x3) + 1) * ADTS_SAMPLES_PER_BLOCK;
+
+    return f->rate != 0 && f->len >= ADTS_HEADER_LEN;
+}
+
+/*
+ * ADTS_Duration -- Playing time of an ADTS stream in microseconds.
+ */
+static inline int64_t
+ADTS_Duration(const char *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    size_t off = 0;
+    int64_t samples = 0;
+    uint32_t rate = 0;
+    ADTSFrame f;
+
+    while (off < len && ADTS_Parse(p + off, len - off, &f)) {
+        samples += f.samples;
+        rate = f.rate;
+        off += f.len;
+    }
+
+    return (rate == 0) ? 0 : samples * 1000000 / rate;
+}
+
+/*
+ * ADTSIndex -- Byte offset of every ADTS_INDEX_STRIDE'th frame and the sample
+ * it starts at, so that playback can begin anywhere in a loaded song without
+ * parsing it from the start.  A 10 MB song needs well under 100 KB.
+ */
+class ADTSIndex
+{
+public:
+    struct Entry
+    {
+        uint32_t offset;    // Byte offset of the frame
+        uint32_t sample;    // First sample of the frame
+    };
+
+    ADTSIndex() : entries(), samples(0), rate(0) { }
+
+    /*
+     * build -- Index buf.  Returns false if buf does not start with a valid
+     * ADTS frame, trailing garbage is ignored.
+     */
+    bool build(const char *buf, size_t len) {
+        const unsigned char *p = (const unsigned char *)buf;
+        size_t off = 0;
+        uint32_t frame = 0;
+        ADTSFrame f;
+
+        entries.clear();
+        samples = 0;
+        rate = 0;
+
+        while (off < len && ADTS_Parse(p + off, len - off, &f)) {
+            if (frame % ADTS_INDEX_STRIDE == 0)
+                entries.push_back(Entry{ (uint32_t)off, samples });
+            samples += f.samples;
+            rate = f.rate;
+            off += f.len;
+            frame++;
+        }
+
+        return rate != 0;
+    }
+
+    /*
+     * seek -- Find where to start decoding so that sample target comes out
+     * with a clean overlap.  AAC frames overlap their neighbour, so decoding
+     * starts one frame early and that frame's output must be discarded along
+     * with the samples before target.  Returns false past the end of the song.
+     */
+    bool seek(const char *buf, size_t len, uint32_t target,
+              size_t *offset, uint32_t *discard) const {
+        const unsigned char *p = (const unsigned char *)buf;
+        ADTSFrame f;
+
+        if (target >= samples || entries.empty())
+            return false;
+
+        auto it = std::upper_bound(entries.begin(), entries.end(), target,
+                                   [](uint32_t t, const Entry &e) {
+                                       return t < e.sample;
+                                   });
+        --it;
+
+        // Walk at most ADTS_INDEX_STRIDE frames to the one holding target
+        size_t off = it->offset;
+        size_t prevOff = off;
+        uint32_t start = it->sample;
+        uint32_t prevStart = start;
+
+        if (it != entries.begin()) {
+            // Last frame of the previous stride primes the decoder
+            size_t o = (it - 1)->offset;
+            uint32_t s = (it - 1)->sample;
+
+            while (o < off && ADTS_Parse(p + o, len - o, &f)) {
+                prevOff = o;
+                prevStart = s;
+                o += f.len;
+                s += f.samples;
+            }
+        }
+
+        while (ADTS_Parse(p + off, len - off, &f) &&
+               start + f.samples <= target) {
+            prevOff = off;
+            prevStart = start;
+            off += f.len;
+            start += f.samples;
+        }
+
+        *offset = prevOff;
+        *discard = target - prevStart;
+
+        return true;
+    }
+
+    uint32_t getSamples() const { return samples; }
+    uint32_t getRate() const { return rate; }
+private:
+    std::vector<Entry> entries;
+    uint32_t samples;   // Samples per channel in the song
+    uint32_t rate;      // Sampling frequency (Hz)
+};
+
+#endif /* __ADTS_H__ */
+
@@ -0,0 +1,339 @@
+/*
+ * Local Clock Sources
+ *
+ * Every time sync sample, liveness check and getTime() reads the local clock.
+ * gettimeofday() is a full call with microsecond resolution, reading the TSC
+ * takes a few nanoseconds.  The TSC is only usable when it ticks at a constant
+ * rate across power states and cores (invariant TSC), and its rate is only
+ * nominal, so it is measured against CLOCK_MONOTONIC.
+ *
+ * Calibration keeps the first (TSC, CLOCK_MONOTONIC) pair as an anchor.  Each
+ * recalibration measures the rate over the whole interval since the anchor,
+ * which gets more precise the longer we run, and slews the TSC clock back onto
+ * CLOCK_MONOTONIC over the next period instead of stepping it.  Time sync
+ * deltas are taken as minimums over many samples, a step would poison them.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __FreeBSD__
+#include <sys/sysctl.h>
+#endif
+
+#include "clock.h"
+
+#ifdef CLOCK_HAVE_TSC
+#include <cpuid.h>
+#endif
+
+using namespace std;
+
+#define CLOCK_CAL_SAMPLES   8                   // Pairs tried per reading
+#define CLOCK_CAL_WAIT      (50 * 1000)         // Initial calibration (us)
+#define CLOCK_RECAL_NS      1000000000LL        // Recalibration period
+#define CLOCK_MAX_SLEW_NS   1000000LL           // Step beyond this error
+
+#define BOOTID_PROCFS   "/proc/sys/kernel/random/boot_id"
+
+#define CLOCKSOURCE_SYSFS \
+    "/sys/devices/system/clocksource/clocksource0/current_clocksource"
+
+std::atomic<ClockSource> clockSource(CLOCK_SRC_REALTIME);
+ClockParams clockParams[2];
+std::atomic<unsigned> clockGen(0);
+ClockSkew clockSkew = { false, 0, 0, 0 };
+
+bool
+ParseClockSource(const char *str, ClockSource *src)
+{
+    if (strcmp(str, "realtime") == 0) {
+        *src = CLOCK_SRC_REALTIME;
+    } else if (strcmp(str, "monotonic") == 0) {
+        *src = CLOCK_SRC_MONOTONIC;
+    } else if (strcmp(str, "tsc") == 0) {
+        *src = CLOCK_SRC_TSC;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+const char *
+ClockSourceName(ClockSource src)
+{
+    switch (src) {
+        case CLOCK_SRC_MONOTONIC:
+            return "monotonic";
+        case CLOCK_SRC_TSC:
+            return "tsc";
+        default:
+            return "realtime";
+    }
+}
+
+#ifdef CLOCK_HAVE_TSC
+
+static uint64_t calTsc;     // Calibration anchor
+static int64_t calNs;
+static uint64_t lastTsc;
+
+static int64_t
+MonotonicNS()
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+
+    return (int64_t)tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+/*
+ * ReadPair -- Read the TSC and CLOCK_MONOTONIC at (nearly) the same instant.
+ * The pair with the tightest TSC bracket around the clock_gettime() wins.
+ */
+static void
+ReadPair(uint64_t *tsc, int64_t *ns)
+{
+    uint64_t best = UINT64_MAX;
+
+    for (int i = 0; i < CLOCK_CAL_SAMPLES; i++) {
+        uint64_t t0 = __rdtsc();
+        int64_t m = MonotonicNS();
+        uint64_t t1 = __rdtsc();
+
+        if (t1 - t0 < best) {
+            best = t1 - t0;
+            *tsc = t0 + (t1 - t0) / 2;
+            *ns = m;
+        }
+    }
+}
+
+/*
+ * TSCUsable -- Check for an invariant TSC that the kernel also trusts.  Linux
+ * switches away from the TSC clocksource when it finds it unstable.
+ */
+static bool
+TSCUsable()
+{
+    unsigned int eax, ebx, ecx, edx;
+    char cs[32];
+    FILE *f;
+
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) ||
+        eax < 0x80000007) {
+        printf("clock: cpu does not report TSC properties\n");
+        return false;
+    }
+
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    if ((edx & (1 << 8)) == 0) {
+        printf("clock: TSC is not invariant\n");
+        return false;
+    }
+
+    f = fopen(CLOCKSOURCE_SYSFS, "r");
+    if (f != nullptr) {
+        if (fgets(cs, sizeof(cs), f) != nullptr &&
+            strncmp(cs, "tsc", 3) != 0) {
+            cs[strcspn(cs, "\n")] = '\0';
+            printf("clock: kernel clocksource is %s, not the TSC\n", cs);
+            fclose(f);
+            return false;
+        }
+        fclose(f);
+    }
+
+    return true;
+}
+
+static bool
+TSCInit()
+{
+    uint64_t tsc;
+    int64_t ns;
+
+    if (!TSCUsable())
+        return false;
+
+    ReadPair(&calTsc, &calNs);
+    usleep(CLOCK_CAL_WAIT);
+    ReadPair(&tsc, &ns);
+
+    if (tsc <= calTsc || ns <= calNs) {
+        printf("clock: TSC calibration failed\n");
+        return false;
+    }
+
+    clockParams[0].tscBase = tsc;
+    clockParams[0].base = ns;
+    clockParams[0].mult =
+        (uint64_t)(((unsigned __int128)(ns - calNs) << 32) / (tsc - calTsc));
+    clockGen.store(0, memory_order_release);
+    lastTsc = tsc;
+
+    printf("clock: TSC at %.3f MHz\n",
+           (double)(tsc - calTsc) * 1000.0 / (double)(ns - calNs));
+
+    return true;
+}
+
+#endif
+
+/*
+ * ClockInit -- Select the clock source, falling back to CLOCK_SRC_MONOTONIC
+ * if the TSC cannot be used.  Returns the source in use.  Call before any
+ * thread reads the clock.
+ */
+ClockSource
+ClockInit(ClockSource src)
+{
+    if (src == CLOCK_SRC_TSC) {
+#ifdef CLOCK_HAVE_TSC
+        if (!TSCInit())
+            src = CLOCK_SRC_MONOTONIC;
+#else
+        printf("clock: no TSC on this architecture\n");
+        src = CLOCK_SRC_MONOTONIC;
+#endif
+        if (src != CLOCK_SRC_TSC)
+            printf("clock: falling back to monotonic\n");
+    }
+
+    clockSource.store(src);
+    printf("clock: using %s\n", ClockSourceName(src));
+
+    return src;
+}
+
+/*
+ * ClockRecalibrate -- Refine the TSC rate and slew the TSC clock onto
+ * CLOCK_MONOTONIC.  Called about every CLOCK_RECAL_NS from a single thread.
+ */
+void
+ClockRecalibrate()
+{
+#ifdef CLOCK_HAVE_TSC
+    uint64_t tsc;
+    int64_t ns;
+    int64_t now;
+    int64_t err;
+    uint64_t mult;
+    unsigned gen;
+
+    if (clockSource.load(memory_order_relaxed) != CLOCK_SRC_TSC)
+        return;
+
+    ReadPair(&tsc, &ns);
+    if (tsc <= lastTsc) {
+        printf("clock: TSC went backwards, falling back to monotonic\n");
+        clockSource.store(CLOCK_SRC_MONOTONIC);
+        return;
+    }
+    lastTsc = tsc;
+
+    gen = clockGen.load(memory_order_relaxed);
+    const ClockParams &cur = clockParams[gen & 1];
+    ClockParams &next = clockParams[(gen + 1) & 1];
+
+    now = cur.base +
+          (int64_t)(((unsigned __int128)(tsc - cur.tscBase) * cur.mult) >> 32);
+    err = ns - now;
+    mult = (uint64_t)(((unsigned __int128)(ns - calNs) << 32) /
+                      (tsc - calTsc));
+
+    next.tscBase = tsc;
+    if (err > CLOCK_MAX_SLEW_NS || err < -CLOCK_MAX_SLEW_NS) {
+        printf("clock: TSC off by %lld ns, stepping\n", (long long)err);
+        next.base = ns;
+        next.mult = mult;
+    } else {
+        // Absorb the error over the next period
+        next.base = now;
+        next.mult = (uint64_t)((unsigned __int128)mult *
+                               (uint64_t)(CLOCK_RECAL_NS + err) /
+                               CLOCK_RECAL_NS);
+    }
+
+    clockGen.store(gen + 1, memory_order_release);
+#endif
+}
+
+
+/*
+ * ClockSetSkew -- Make this instance's clock run offsetUs ahead and ppm fast
+ * so that several instances on one host behave like separate machines.  Call
+ * after ClockInit() and before any thread reads the clock.
+ */
+void
+ClockSetSkew(int64_t offsetUs, double ppm)
+{
+    clockSkew.offset = offsetUs * 1000;
+    clockSkew.ppb = (int64_t)(ppm * 1000.0);
+    clockSkew.base = ClockRawNS();
+    clockSkew.enabled = (clockSkew.offset != 0 || clockSkew.ppb != 0);
+
+    if (clockSkew.enabled) {
+        printf("clock: injecting %lld us offset, %.3f ppm drift\n",
+               (long long)offsetUs, ppm);
+    }
+}
+
+static uint32_t
+Hash(uint32_t h, const void *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+
+    // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619;
+    }
+
+    return h;
+}
+
+/*
+ * ClockEpoch -- Identifies the origin of the local clock.  Time sync deltas
+ * taken against one epoch are meaningless in another, so it changes with the
+ * clock source, with every boot for the boot relative sources and with the
+ * injected skew.
+ */
+uint32_t
+ClockEpoch()
+{
+    uint32_t h = 2166136261u;
+    ClockSource src = clockSource.load();
+
+    h = Hash(h, &src, sizeof(src));
+
+    if (src != CLOCK_SRC_REALTIME) {
+#if defined(__FreeBSD__)
+        struct timeval boot;
+        size_t len = sizeof(boot);
+
+        if (sysctlbyname("kern.boottime", &boot, &len, nullptr, 0) == 0)
+            h = Hash(h, &boot.tv_sec, sizeof(boot.tv_sec));
+#else
+        char id[64] = { 0 };
+        FILE *f = fopen(BOOTID_PROCFS, "r");
+
+        if (f != nullptr) {
+            if (fgets(id, sizeof(id), f) != nullptr)
+                h = Hash(h, id, strlen(id));
+            fclose(f);
+        }
+#endif
+    }
+
+    if (clockSkew.enabled) {
+        h = Hash(h, &clockSkew.offset, sizeof(clockSkew.offset));
+        // Injected drift accumulates from startup, every run is a new epoch
+        if (clockSkew.ppb != 0)
+            h = Hash(h, &clockSkew.base, sizeof(clockSkew.base));
+    }
+
+    return h;
+}
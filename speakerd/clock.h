@@ -0,0 +1,126 @@
+
+#ifndef __CLOCK_H__
+#define __CLOCK_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CLOCK_HAVE_TSC  1
+#endif
+
+/*
+ * Local clock used for time sync samples, liveness and playback scheduling.
+ *
+ *   CLOCK_SRC_REALTIME     gettimeofday(), microsecond resolution (default)
+ *   CLOCK_SRC_MONOTONIC    clock_gettime(CLOCK_MONOTONIC), served by the vDSO
+ *   CLOCK_SRC_TSC          Invariant TSC scaled to CLOCK_MONOTONIC
+ *
+ * The TSC source is calibrated against CLOCK_MONOTONIC at startup and slewed
+ * back onto it by ClockRecalibrate().  Where the TSC is not invariant, or the
+ * kernel does not trust it, ClockInit() falls back to CLOCK_SRC_MONOTONIC.
+ *
+ * All machines in a cluster must use the same rate, not the same source: time
+ * sync only measures offsets, so sources with different epochs can be mixed.
+ */
+enum ClockSource
+{
+    CLOCK_SRC_REALTIME,
+    CLOCK_SRC_MONOTONIC,
+    CLOCK_SRC_TSC,
+};
+
+// TSC to nanoseconds: ns = base + ((tsc - tscBase) * mult) >> 32
+struct ClockParams
+{
+    uint64_t tscBase;
+    int64_t base;
+    uint64_t mult;
+};
+
+// Injected error for testing: offset plus drift in parts per billion
+struct ClockSkew
+{
+    bool enabled;
+    int64_t offset;     // Nanoseconds
+    int64_t ppb;
+    int64_t base;       // Raw time drift is measured from
+};
+
+extern std::atomic<ClockSource> clockSource;
+extern ClockSkew clockSkew;
+extern ClockParams clockParams[2];
+extern std::atomic<unsigned> clockGen;
+
+bool ParseClockSource(const char *str, ClockSource *src);
+const char *ClockSourceName(ClockSource src);
+ClockSource ClockInit(ClockSource src);
+void ClockRecalibrate();
+void ClockSetSkew(int64_t offsetUs, double ppm);
+uint32_t ClockEpoch();
+
+/*
+ * ClockRawNS -- Time from the selected source in nanoseconds.
+ */
+static inline int64_t
+ClockRawNS()
+{
+    switch (clockSource.load(std::memory_order_relaxed)) {
+#ifdef CLOCK_HAVE_TSC
+        case CLOCK_SRC_TSC: {
+            // Parameters are double buffered, the writer flips clockGen
+            const ClockParams &p =
+                clockParams[clockGen.load(std::memory_order_acquire) & 1];
+            uint64_t delta = __rdtsc() - p.tscBase;
+
+            return p.base +
+                   (int64_t)(((unsigned __int128)delta * p.mult) >> 32);
+        }
+#endif
+        case CLOCK_SRC_MONOTONIC: {
+            struct timespec tp;
+
+            clock_gettime(CLOCK_MONOTONIC, &tp);
+            return (int64_t)tp.tv_sec * 1000000000 + tp.tv_nsec;
+        }
+        default: {
+            struct timeval tp;
+
+            gettimeofday(&tp, nullptr);
+            return (int64_t)tp.tv_sec * 1000000000 +
+                   (int64_t)tp.tv_usec * 1000;
+        }
+    }
+}
+
+/*
+ * ClockNowNS -- Local time in nanoseconds, including any injected skew.
+ */
+static inline int64_t
+ClockNowNS()
+{
+    int64_t t = ClockRawNS();
+
+    if (clockSkew.enabled) {
+        t += clockSkew.offset + (t - clockSkew.base) * clockSkew.ppb /
+                                1000000000;
+    }
+
+    return t;
+}
+
+/*
+ * ClockNow -- Local time in microseconds, the unit used on the wire.
+ */
+static inline int64_t
+ClockNow()
+{
+    return ClockNowNS() / 1000;
+}
+
+#endif /* __CLOCK_H__ */
+
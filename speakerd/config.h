@@ -0,0 +1,52 @@
+
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+#include <string>
+
+#include "clock.h"
+#include "pcm.h"
+
+/*
+ * Per device settings, see -o.  Defaults come from the global options.
+ */
+struct OutputConfig
+{
+    std::string device;     // See AudioOutput::create()
+    double gain;            // Output gain in dB
+    ChannelMap chanmap;     // Part of the stereo image this device plays
+    int latency;            // Target device buffer (ms), 0 for the default
+    int64_t delay;          // Device output latency (us), -1 for the profile
+};
+
+/*
+ * Runtime configuration of speakerd, filled in from the command line.
+ */
+struct SpeakerConfig
+{
+    double gain;            // Output gain in dB
+    ChannelMap chanmap;     // Part of the stereo image this speaker plays
+    int format;             // Requested device sample format (AFMT_*)
+    int rate;               // Requested device sample rate
+    int rtPriority;         // SCHED_FIFO priority, 0 disables realtime mode
+    int outputCpu;          // CPU for the output thread, -1 to not pin
+    int syncCpu;            // CPU for the time sync threads, -1 to not pin
+    const char *registry;   // Live speaker list for lpr-music, "" disables
+    ClockSource clock;      // Local clock for time sync and scheduling
+    const char *device;     // Output device when -o is not given
+    const char *profile;    // Output latency profile, "" disables
+    int latency;            // Target device buffer (ms), 0 for the default
+    const char *bindAddr;   // Local address for all sockets, "" for any
+    const char *peers;      // Where time sync announcements go
+    int port;               // Command port
+    int syncPort;           // Time sync port
+    const char *state;      // Time sync checkpoint, "" disables
+    uint32_t group;         // Sync group, other groups are ignored
+    int64_t clockOffset;    // Injected clock offset (us)
+    double clockDrift;      // Injected clock drift (ppm)
+};
+
+extern SpeakerConfig config;
+
+#endif /* __CONFIG_H__ */
+
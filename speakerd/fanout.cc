@@ -0,0 +1,116 @@
+/*
+ * PCM Fanout
+ *
+ * A host driving several sound cards decodes each song once.  The decoder
+ * thread fills chunks in the native layout of the stream and each output
+ * thread applies its own channel map, gain and format conversion.  The ring
+ * is preallocated so neither side allocates while playing.
+ */
+
+#include "fanout.h"
+#include "realtime.h"
+
+using namespace std;
+
+PcmFanout::PcmFanout(int consumers)
+    : lock(), cv(), chunks(new PcmChunk[FANOUT_CHUNKS]), consumers(consumers),
+      done(false), head(0), tail()
+{
+}
+
+PcmFanout::~PcmFanout()
+{
+    delete[] chunks;
+}
+
+uint64_t
+PcmFanout::slowest()
+{
+    uint64_t min = head;
+
+    for (int i = 0; i < consumers; i++) {
+        if (tail[i] < min)
+            min = tail[i];
+    }
+
+    return min;
+}
+
+/*
+ * reserve -- Wait for a free slot and return it for filling.  Returns nullptr
+ * after shutdown().
+ */
+PcmChunk *
+PcmFanout::reserve()
+{
+    unique_lock<mutex> lk(lock);
+
+    while (!done && head - slowest() >= FANOUT_CHUNKS) {
+        cv.wait(lk);
+    }
+    if (done)
+        return nullptr;
+
+    return &chunks[head % FANOUT_CHUNKS];
+}
+
+/*
+ * commit -- Publish the chunk returned by reserve().
+ */
+void
+PcmFanout::commit()
+{
+    {
+        lock_guard<mutex> lk(lock);
+        head++;
+    }
+    cv.notify_all();
+}
+
+/*
+ * next -- Wait for the next chunk for this consumer.  Returns nullptr after
+ * shutdown().
+ */
+const PcmChunk *
+PcmFanout::next(int consumer)
+{
+    unique_lock<mutex> lk(lock);
+
+    while (!done && tail[consumer] == head) {
+        cv.wait(lk);
+    }
+    if (done)
+        return nullptr;
+
+    return &chunks[tail[consumer] % FANOUT_CHUNKS];
+}
+
+void
+PcmFanout::release(int consumer)
+{
+    {
+        lock_guard<mutex> lk(lock);
+        tail[consumer]++;
+    }
+    cv.notify_all();
+}
+
+void
+PcmFanout::shutdown()
+{
+    {
+        lock_guard<mutex> lk(lock);
+        done = true;
+    }
+    cv.notify_all();
+}
+
+/*
+ * prefault -- Back the ring with memory, see RTPrefault().
+ */
+void
+PcmFanout::prefault()
+{
+    RTPrefault(chunks, sizeof(PcmChunk) * FANOUT_CHUNKS);
+}
+
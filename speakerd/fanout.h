@@ -0,0 +1,70 @@
+
+#ifndef __FANOUT_H__
+#define __FANOUT_H__
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <mutex>
+
+#include "pcm.h"
+
+#define FANOUT_CHUNKS       64      // About 1.5 s of AAC frames
+#define FANOUT_MAX_FRAMES   2048    // Largest decoded frame (HE-AAC)
+#define FANOUT_MAX_OUTPUTS  8
+
+enum PcmChunkType
+{
+    PCM_CHUNK_START,    // A song starts at start (cluster time)
+    PCM_CHUNK_DATA,     // Decoded PCM
+    PCM_CHUNK_END,      // The song is over
+};
+
+/*
+ * PcmChunk -- One decoded frame in the decoder's native layout.
+ */
+struct PcmChunk
+{
+    PcmChunkType type;
+    int64_t start;          // START: cluster time of the first sample
+    int64_t position;       // START, DATA: song sample of the first frame
+    uint32_t gen;           // Bumped by every SEEK, stale chunks are skipped
+    int rate;
+    int channels;
+    unsigned int frames;
+    PcmPosition layout[PCM_MAX_CHANNELS];
+    int16_t pcm[FANOUT_MAX_FRAMES * PCM_MAX_CHANNELS];
+};
+
+/*
+ * PcmFanout -- Ring of decoded chunks with one producer and a fixed set of
+ * consumers.  Every consumer sees every chunk, a slot is reused once all of
+ * them have released it, so the decoder runs at most FANOUT_CHUNKS ahead of
+ * the slowest output.
+ */
+class PcmFanout
+{
+public:
+    PcmFanout(int consumers);
+    ~PcmFanout();
+    PcmFanout(const PcmFanout &) = delete;
+    PcmFanout &operator=(const PcmFanout &) = delete;
+    PcmChunk *reserve();
+    void commit();
+    const PcmChunk *next(int consumer);
+    void release(int consumer);
+    void shutdown();
+    void prefault();
+private:
+    uint64_t slowest();
+    std::mutex lock;
+    std::condition_variable cv;
+    PcmChunk *chunks;
+    int consumers;
+    bool done;
+    uint64_t head;                          // Next chunk to produce
+    uint64_t tail[FANOUT_MAX_OUTPUTS];      // Next chunk per consumer
+};
+
+#endif /* __FANOUT_H__ */
+
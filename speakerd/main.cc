@@ -1,23 +1,340 @@
 
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+/*
+ * XXX: ChangeMe when recompiling on other platforms
+ * BSD OSS is in sys/soundcard.h
+ * Linux uses linux/soundcard.h
+ */
+#include <sys/soundcard.h>
 
+#include <string>
+#include <vector>
+
+#include "clock.h"
+#include "config.h"
+#include "output.h"
+#include "perf.h"
+#include "player.h"
+#include "printer.h"
+#include "realtime.h"
+#include "speaker.h"
 #include "timesync.h"
 
+using namespace std;
+
 TimeSync *ts;
-int listen_to_commands(TimeSync *ts);
+Player *player;
+
+SpeakerConfig config = {
+    0.0,            // gain
+    CHMAP_STEREO,   // chanmap
+    AFMT_S16_NE,    // format
+    44100,          // rate
+    0,              // rtPriority
+    -1,             // outputCpu
+    -1,             // syncCpu
+    MUSICPRINTER_REGISTRY, // registry
+    CLOCK_SRC_REALTIME, // clock
+    OUTPUT_DEFAULT, // device
+    OUTPUT_PROFILE, // profile
+    OUTPUT_LATENCY, // latency
+    "",             // bindAddr
+    TIMESYNC_BROADCAST, // peers
+    MUSICPRINTER_PORT, // port
+    TIMESYNC_PORT,  // syncPort
+    "",             // state
+    0,              // group
+    0,              // clockOffset
+    0.0,            // clockDrift
+};
+
+static void
+Usage(const char *prog)
+{
+    printf("Usage: %s [-g GAIN_DB] [-m stereo|swap|left|right|mono]\n"
+           "          [-r RATE] [-f s16|s32]\n"
+           "          [-R PRIORITY] [-c OUTPUT_CPU] [-C SYNC_CPU]\n"
+           "          [-n REGISTRY] [-k realtime|monotonic|tsc]\n"
+           "          [-o OUTPUT [-o OUTPUT...]] [-l LATENCY_MS]\n"
+           "          [-L PROFILE] [-M]\n"
+           "          [-b BIND_ADDR] [-p PEER[,PEER...]]\n"
+           "          [-P PORT] [-S SYNC_PORT] [-G GROUP] [-s STATE]\n"
+           "          [-O CLOCK_OFFSET_US] [-D CLOCK_DRIFT_PPM]\n", prog);
+    printf("Peers may be broadcast, unicast or multicast addresses.  For a\n"
+           "cluster on one host give each instance its own loopback address\n"
+           "with -b and list all of them with -p.  -s is where the clock\n"
+           "model is checkpointed for a warm start, off by default.  Give\n"
+           "every instance on a host its own file.\n");
+    printf("OUTPUT is DEVICE|file:PATH[,map=MAP][,gain=DB][,latency=MS]"
+           "[,delay=US],\n"
+           "every output plays the same decoded stream and defaults to the\n"
+           "-m, -g and -l settings.\n");
+    printf("delay is how long the device takes from write to sound, each\n"
+           "device starts that much early.  Without it the delay comes from\n"
+           "the latency profile.  -M measures every output through a\n"
+           "loopback from its output to its input, saves the profile and\n"
+           "exits.\n");
+}
+
+/*
+ * MeasureOutputs -- Measure the output latency of every output and store it
+ * in the profile, -M.
+ */
+static int
+MeasureOutputs(const vector<OutputConfig> &outputs, LatencyProfile *profile)
+{
+    int failed = 0;
+
+    for (auto &&o : outputs) {
+        AudioOutput *dev = AudioOutput::create(o.device.c_str(), o.latency);
+        DeviceFormat fmt = { config.format, 2, config.rate };
+        int64_t latency;
+
+        if (dev->measureLatency(&fmt, &latency)) {
+            printf("%s: output latency %lld us\n", o.device.c_str(),
+                   (long long)latency);
+            (*profile)[o.device] = latency;
+        } else {
+            printf("%s: cannot measure output latency\n", o.device.c_str());
+            failed++;
+        }
+        delete dev;
+    }
+
+    if (*config.profile == '\0') {
+        printf("No latency profile to save to (-L)\n");
+        return 1;
+    }
+    if (!SaveLatencyProfile(config.profile, *profile))
+        return 1;
+
+    return failed ? 1 : 0;
+}
+
+static bool
+ParseFormat(const char *str, int *fmt)
+{
+    if (strcmp(str, "s16") == 0) {
+        *fmt = AFMT_S16_NE;
+        return true;
+    }
+#ifdef AFMT_S32_NE
+    if (strcmp(str, "s32") == 0) {
+        *fmt = AFMT_S32_NE;
+        return true;
+    }
+#endif
+
+    return false;
+}
+
+/*
+ * ParseOutput -- Parse DEVICE[,key=value...] from -o into out, which holds
+ * the defaults on entry.
+ */
+static bool
+ParseOutput(const char *spec, OutputConfig *out)
+{
+    string s = spec;
+    size_t pos = s.find(',');
+
+    out->device = s.substr(0, pos);
+    if (out->device.empty())
+        return false;
+
+    while (pos != string::npos) {
+        size_t next = s.find(',', pos + 1);
+        string opt = s.substr(pos + 1, next == string::npos ? next : next - pos - 1);
+        size_t eq = opt.find('=');
+        string key = opt.substr(0, eq);
+        const char *val;
+
+        if (eq == string::npos)
+            return false;
+        val = opt.c_str() + eq + 1;
+
+        if (key == "map") {
+            if (!ParseChannelMap(val, &out->chanmap))
+                return false;
+        } else if (key == "gain") {
+            out->gain = atof(val);
+        } else if (key == "latency") {
+            out->latency = atoi(val);
+        } else if (key == "delay") {
+            out->delay = strtoll(val, nullptr, 0);
+        } else {
+            return false;
+        }
+
+        pos = next;
+    }
+
+    return true;
+}
 
 #define SECOND 1000000
 int
-main(int argc, const char *argv[])
+main(int argc, char *argv[])
 {
+    int ch;
+    vector<const char *> specs;
+    vector<OutputConfig> outputs;
+    LatencyProfile profile;
+    bool measure = false;
+
+    while ((ch = getopt(argc, argv, "b:c:C:D:f:g:G:k:l:L:m:Mn:o:O:p:P:r:R:s:S:h")) != -1) {
+        switch (ch) {
+            case 'b':
+                config.bindAddr = optarg;
+                break;
+            case 'c':
+                config.outputCpu = atoi(optarg);
+                break;
+            case 'C':
+                config.syncCpu = atoi(optarg);
+                break;
+            case 'D':
+                config.clockDrift = atof(optarg);
+                break;
+            case 'f':
+                if (!ParseFormat(optarg, &config.format)) {
+                    printf("Unsupported sample format '%s'\n", optarg);
+                    Usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'g':
+                config.gain = atof(optarg);
+                break;
+            case 'G':
+                config.group = strtoul(optarg, nullptr, 0);
+                break;
+            case 'k':
+                if (!ParseClockSource(optarg, &config.clock)) {
+                    printf("Unknown clock source '%s'\n", optarg);
+                    Usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'l':
+                config.latency = atoi(optarg);
+                break;
+            case 'L':
+                config.profile = optarg;
+                break;
+            case 'm':
+                if (!ParseChannelMap(optarg, &config.chanmap)) {
+                    printf("Unknown channel map '%s'\n", optarg);
+                    Usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'M':
+                measure = true;
+                break;
+            case 'n':
+                config.registry = optarg;
+                break;
+            case 'o':
+                specs.push_back(optarg);
+                break;
+            case 'O':
+                config.clockOffset = strtoll(optarg, nullptr, 0);
+                break;
+            case 'p':
+                config.peers = optarg;
+                break;
+            case 'P':
+                config.port = atoi(optarg);
+                break;
+            case 'r':
+                config.rate = atoi(optarg);
+                break;
+            case 'R':
+                config.rtPriority = atoi(optarg);
+                break;
+            case 's':
+                config.state = optarg;
+                break;
+            case 'S':
+                config.syncPort = atoi(optarg);
+                break;
+            case 'h':
+            default:
+                Usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (specs.empty())
+        specs.push_back(config.device);
+    if (specs.size() > FANOUT_MAX_OUTPUTS) {
+        printf("At most %d outputs\n", FANOUT_MAX_OUTPUTS);
+        return 1;
+    }
+    for (auto &&spec : specs) {
+        OutputConfig out = { "", config.gain, config.chanmap, config.latency, -1 };
+
+        if (!ParseOutput(spec, &out)) {
+            printf("Invalid output '%s'\n", spec);
+            Usage(argv[0]);
+            return 1;
+        }
+        outputs.push_back(out);
+    }
+
+    if (*config.profile != '\0' && !LoadLatencyProfile(config.profile, &profile))
+        return 1;
+    if (measure)
+        return MeasureOutputs(outputs, &profile);
+    for (auto &&out : outputs) {
+        if (out.delay < 0) {
+            auto p = profile.find(out.device);
+            out.delay = (p != profile.end()) ? p->second : 0;
+        }
+        printf("Output %s latency %lld us\n", out.device.c_str(),
+               (long long)out.delay);
+    }
+
     printf("Starting speakerd ...\n");
 
+    // A peer that goes away mid relay must not take us down with it
+    signal(SIGPIPE, SIG_IGN);
+    PerfInit();
+
+    config.clock = ClockInit(config.clock);
+    ClockSetSkew(config.clockOffset, config.clockDrift);
+
+    /*
+     * Realtime mode: lock and prefault memory before any thread starts.  The
+     * player and sync threads raise their own priority.
+     */
     ts = new TimeSync();
+    player = new Player(ts, outputs);
+    if (config.rtPriority > 0) {
+        RTLockMemory();
+        player->prefault();
+        ts->setRealtime(config.rtPriority, config.syncCpu);
+    }
+
+    ts->setRegistry(config.registry);
+    ts->setState(config.state);
+    ts->setLatency(player->getLatency());
+    if (!ts->setNetwork(config.bindAddr, config.peers, config.syncPort,
+                        config.group)) {
+        Usage(argv[0]);
+        return 1;
+    }
     ts->start();
+    player->start();
 
-    listen_to_commands(ts); 
+    listen_to_commands(ts, player); 
 
+    player->stop();
     ts->stop();
 }
 
@@ -0,0 +1,598 @@
+/*
+ * Audio Outputs
+ *
+ * The output is picked with -o: a path opens an OSS device, "file:PATH"
+ * writes to a file instead.  The file output lets several speakerd instances
+ * run on one host without sound hardware and records when every sample would
+ * have been played, which is what end to end sync measurements need.
+ *
+ * Left alone, OSS picks its own fragment size and count and a blocking write
+ * may queue a large and unknown amount of audio.  The OSS output asks for a
+ * buffer of the target latency (-l) split into OSS_FRAGMENTS fragments, reads
+ * back what the driver granted and tracks the output delay and underruns.
+ *
+ * Buffering is only part of the story, DACs, amplifiers and powered speakers
+ * add their own delay and it differs between hardware.  The latency profile
+ * records that delay per device, configured by hand or measured with a
+ * loopback from the device's output to its input (speakerd -M), and the
+ * player starts each device early by that much.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include <algorithm>
+#include <vector>
+/*
+ * XXX: ChangeMe when recompiling on other platforms
+ * BSD OSS is in sys/soundcard.h
+ * Linux uses linux/soundcard.h
+ */
+#include <sys/soundcard.h>
+
+#include "clock.h"
+#include "output.h"
+
+using namespace std;
+
+AudioOutput *
+AudioOutput::create(const char *spec, int latencyMs)
+{
+    if (strncmp(spec, OUTPUT_FILE, strlen(OUTPUT_FILE)) == 0)
+        return new FileOutput(spec + strlen(OUTPUT_FILE));
+
+    return new OSSOutput(spec, latencyMs);
+}
+
+static int
+SampleBytes(int format)
+{
+    return (format == AFMT_S16_NE) ? 2 : 4;
+}
+
+OSSOutput::OSSOutput(const char *path, int latencyMs)
+    : path(path), latencyMs(latencyMs), fd(-1), bytesPerSec(0),
+      bufferBytes(0), started(false), underruns(0), maxDelay(0)
+{
+}
+
+OSSOutput::~OSSOutput()
+{
+    close();
+}
+
+/*
+ * open -- Open the sound device and request the format, channels and rate in
+ * dev.  The device may substitute its own values, the ones it settled on are
+ * returned in dev.
+ */
+bool
+OSSOutput::open(DeviceFormat *dev)
+{
+    int status;
+    audio_buf_info info;
+
+    fd = ::open(path.c_str(), O_WRONLY | O_NONBLOCK);
+    if (fd < 0) {
+        perror("open dsp");
+        return false;
+    }
+
+    // The fragment layout must be set before the format
+    setFragments(*dev);
+
+    int fmt = dev->format;
+    status = ioctl(fd, SNDCTL_DSP_SETFMT, &fmt);
+    if (status < 0) {
+        perror("ioctl SETFMT");
+        close();
+        return false;
+    }
+#ifdef AFMT_S32_NE
+    if (fmt != AFMT_S16_NE && fmt != AFMT_S32_NE) {
+#else
+    if (fmt != AFMT_S16_NE) {
+#endif
+        printf("Device does not support a usable format (%x)\n", fmt);
+        close();
+        return false;
+    }
+
+    int chans = dev->channels;
+    status = ioctl(fd, SNDCTL_DSP_CHANNELS, &chans);
+    if (status < 0) {
+        perror("ioctl CHANNELS");
+        close();
+        return false;
+    }
+    if (chans != 1 && chans != 2) {
+        printf("Device does not support mono or stereo (%d)\n", chans);
+        close();
+        return false;
+    }
+
+    int speed = dev->rate;
+    status = ioctl(fd, SNDCTL_DSP_SPEED, &speed);
+    if (status < 0) {
+        perror("ioctl SPEED");
+        close();
+        return false;
+    }
+
+    dev->format = fmt;
+    dev->channels = chans;
+    dev->rate = speed;
+
+    bytesPerSec = speed * chans * SampleBytes(fmt);
+    status = ioctl(fd, SNDCTL_DSP_GETOSPACE, &info);
+    if (status < 0) {
+        perror("ioctl GETOSPACE");
+        bufferBytes = 0;
+    } else {
+        bufferBytes = info.fragstotal * info.fragsize;
+        printf("Output buffer %d x %d bytes (%lld us)\n", info.fragstotal,
+               info.fragsize, (long long)getLatency());
+    }
+
+    started = false;
+    underruns = 0;
+    maxDelay = 0;
+
+    return true;
+}
+
+/*
+ * setFragments -- Ask for OSS_FRAGMENTS fragments adding up to about
+ * latencyMs of audio in the requested format.  Fragment sizes are powers of
+ * two, the driver may round further.
+ */
+void
+OSSOutput::setFragments(const DeviceFormat &dev)
+{
+    int64_t bytes;
+    int shift = OSS_MIN_FRAGSHIFT;
+    int frag;
+
+    if (latencyMs <= 0)
+        return;
+
+    bytes = (int64_t)dev.rate * dev.channels * SampleBytes(dev.format) *
+            latencyMs / 1000 / OSS_FRAGMENTS;
+    while (((int64_t)2 << shift) <= bytes && shift < 16) {
+        shift++;
+    }
+
+    frag = (OSS_FRAGMENTS << 16) | shift;
+    if (ioctl(fd, SNDCTL_DSP_SETFRAGMENT, &frag) < 0) {
+        perror("ioctl SETFRAGMENT");
+    }
+}
+
+/*
+ * write -- Queue all of buf, waiting in poll() whenever the buffer is full.
+ */
+bool
+OSSOutput::write(const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+
+    if (started)
+        checkUnderrun();
+
+    while (len > 0) {
+        ssize_t status = ::write(fd, p, len);
+
+        if (status < 0) {
+            struct pollfd pfd = { fd, POLLOUT, 0 };
+
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN) {
+                perror("write dsp");
+                return false;
+            }
+
+            // A full buffer drains within its own length, else it stalled
+            status = poll(&pfd, 1, (int)(getLatency() / 1000) + 100);
+            if (status < 0 && errno != EINTR) {
+                perror("poll dsp");
+                return false;
+            }
+            if (status == 0) {
+                printf("Output device stalled\n");
+                return false;
+            }
+            continue;
+        }
+
+        p += status;
+        len -= status;
+    }
+    started = true;
+
+    return true;
+}
+
+/*
+ * checkUnderrun -- Count underruns, from the driver where OSS 4 reports them,
+ * otherwise by finding the buffer empty before a write.
+ */
+void
+OSSOutput::checkUnderrun()
+{
+    int64_t delay = getDelay();
+
+    if (delay < 0)
+        return;
+    if (delay > maxDelay)
+        maxDelay = delay;
+
+#ifdef SNDCTL_DSP_GETERROR
+    audio_errinfo err;
+
+    if (ioctl(fd, SNDCTL_DSP_GETERROR, &err) == 0) {
+        if (err.play_underruns > 0) {
+            underruns += err.play_underruns;
+            printf("Output underrun (%d total)\n", underruns);
+        }
+        return;
+    }
+#endif
+
+    if (delay == 0) {
+        underruns++;
+        printf("Output underrun (%d total)\n", underruns);
+    }
+}
+
+/*
+ * getDelay -- Audio queued in the device in microseconds, -1 if unknown.
+ */
+int64_t
+OSSOutput::getDelay()
+{
+    int bytes;
+
+    if (fd < 0 || bytesPerSec == 0)
+        return -1;
+
+    if (ioctl(fd, SNDCTL_DSP_GETODELAY, &bytes) < 0)
+        return -1;
+
+    return (int64_t)bytes * 1000000 / bytesPerSec;
+}
+
+int64_t
+OSSOutput::getLatency()
+{
+    if (bytesPerSec == 0)
+        return 0;
+
+    return (int64_t)bufferBytes * 1000000 / bytesPerSec;
+}
+
+void
+OSSOutput::close()
+{
+    if (fd >= 0) {
+        if (started) {
+            // Play out what is queued, a non-blocking close may drop it
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            ioctl(fd, SNDCTL_DSP_SYNC, nullptr);
+            printf("Output max delay %lld us, %d underruns\n",
+                   (long long)maxDelay, underruns);
+        }
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+/*
+ * measureLatency -- Measure the output delay of the device with a loopback
+ * cable or monitor path from its output to its input.  Returns the median of
+ * LOOPBACK_RUNS measurements in latency.
+ *
+ * A loopback only sees the round trip through the DAC and the ADC.  Their
+ * pipelines cannot be told apart from here and are usually alike, so half the
+ * round trip is taken as the output delay.
+ */
+bool
+OSSOutput::measureLatency(DeviceFormat *dev, int64_t *latency)
+{
+    vector<int64_t> runs;
+
+    for (int i = 0; i < LOOPBACK_RUNS; i++) {
+        int64_t roundTrip;
+
+        if (!measureOnce(*dev, &roundTrip))
+            return false;
+        runs.push_back(roundTrip);
+    }
+
+    sort(runs.begin(), runs.end());
+    printf("%s: round trip %lld us (%lld .. %lld us)\n", path.c_str(),
+           (long long)runs[runs.size() / 2], (long long)runs.front(),
+           (long long)runs.back());
+    *latency = runs[runs.size() / 2] / 2;
+
+    return true;
+}
+
+/*
+ * measureOnce -- Queue a click with both directions stopped, start them with
+ * a single trigger and find the click in the recording.  Sample positions on
+ * both sides count from the same instant, so the distance between them is
+ * the round trip.
+ */
+bool
+OSSOutput::measureOnce(const DeviceFormat &dev, int64_t *roundTrip)
+{
+    int fmt = AFMT_S16_NE;
+    int chans = 2;
+    int speed = dev.rate;
+    int trig = 0;
+    int lead, click, frames, record;
+    int noise = 0;
+    int threshold;
+    audio_buf_info info;
+    size_t got = 0;
+
+    fd = ::open(path.c_str(), O_RDWR);
+    if (fd < 0) {
+        perror("open dsp for loopback");
+        return false;
+    }
+
+#ifdef SNDCTL_DSP_SETDUPLEX
+    ioctl(fd, SNDCTL_DSP_SETDUPLEX, nullptr);
+#endif
+    if (ioctl(fd, SNDCTL_DSP_SETFMT, &fmt) < 0 || fmt != AFMT_S16_NE ||
+        ioctl(fd, SNDCTL_DSP_CHANNELS, &chans) < 0 || chans != 2 ||
+        ioctl(fd, SNDCTL_DSP_SPEED, &speed) < 0) {
+        printf("%s cannot play and record 16-bit stereo\n", path.c_str());
+        close();
+        return false;
+    }
+
+    if (ioctl(fd, SNDCTL_DSP_SETTRIGGER, &trig) < 0) {
+        perror("ioctl SETTRIGGER");
+        close();
+        return false;
+    }
+    if (ioctl(fd, SNDCTL_DSP_GETOSPACE, &info) < 0) {
+        perror("ioctl GETOSPACE");
+        close();
+        return false;
+    }
+
+    lead = speed * LOOPBACK_LEAD / 1000;
+    click = speed * LOOPBACK_CLICK / 1000;
+    frames = info.bytes / (chans * sizeof(int16_t));
+    if (frames < lead + click) {
+        printf("%s: output buffer too small for the loopback click\n",
+               path.c_str());
+        close();
+        return false;
+    }
+
+    // A burst at a quarter of the sample rate survives AC coupling
+    vector<int16_t> out(frames * chans, 0);
+    for (int i = 0; i < click; i++) {
+        int16_t v = ((i / 2) % 2) ? -24000 : 24000;
+
+        out[(lead + i) * chans] = v;
+        out[(lead + i) * chans + 1] = v;
+    }
+    if (::write(fd, out.data(), out.size() * sizeof(int16_t)) < 0) {
+        perror("write dsp");
+        close();
+        return false;
+    }
+
+    trig = PCM_ENABLE_INPUT | PCM_ENABLE_OUTPUT;
+    if (ioctl(fd, SNDCTL_DSP_SETTRIGGER, &trig) < 0) {
+        perror("ioctl SETTRIGGER");
+        close();
+        return false;
+    }
+
+    record = lead + speed * LOOPBACK_RECORD / 1000;
+    vector<int16_t> in(record * chans);
+    while (got < in.size() * sizeof(int16_t)) {
+        ssize_t status = ::read(fd, (char *)in.data() + got,
+                                in.size() * sizeof(int16_t) - got);
+
+        if (status < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("read dsp");
+            close();
+            return false;
+        }
+        if (status == 0)
+            break;
+        got += status;
+    }
+    close();
+
+    // Nothing played can come back before the click went out
+    for (int i = 0; i < lead * chans; i++) {
+        noise = max(noise, abs((int)in[i]));
+    }
+    threshold = max(noise * 4, LOOPBACK_MIN_LEVEL);
+
+    for (size_t i = lead * chans; i < got / sizeof(int16_t); i++) {
+        if (abs((int)in[i]) >= threshold) {
+            *roundTrip = (int64_t)(i / chans - lead) * 1000000 / speed;
+            return true;
+        }
+    }
+
+    printf("%s: click not recorded, is the output looped back to the "
+           "input?\n", path.c_str());
+    return false;
+}
+
+/*
+ * LoadLatencyProfile -- Read "device latency_us" lines from path.  A missing
+ * file is an empty profile.
+ */
+bool
+LoadLatencyProfile(const string &path, LatencyProfile *profile)
+{
+    FILE *f;
+    char line[512];
+
+    f = fopen(path.c_str(), "r");
+    if (f == nullptr) {
+        if (errno == ENOENT)
+            return true;
+        perror("fopen latency profile");
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), f) != nullptr) {
+        char dev[256];
+        long long us;
+
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%255s %lld", dev, &us) != 2)
+            continue;
+        (*profile)[dev] = us;
+    }
+    fclose(f);
+
+    return true;
+}
+
+/*
+ * SaveLatencyProfile -- Write profile to path, replacing it atomically.
+ */
+bool
+SaveLatencyProfile(const string &path, const LatencyProfile &profile)
+{
+    FILE *f;
+    string tmp = path + ".tmp." + to_string(getpid());
+
+    f = fopen(tmp.c_str(), "w");
+    if (f == nullptr) {
+        perror("fopen latency profile");
+        return false;
+    }
+
+    fprintf(f, "# device latency_us\n");
+    for (auto &&p : profile) {
+        fprintf(f, "%s %lld\n", p.first.c_str(), (long long)p.second);
+    }
+
+    if (fclose(f) != 0 || rename(tmp.c_str(), path.c_str()) < 0) {
+        perror("write latency profile");
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+FileOutput::FileOutput(const char *path)
+    : path(path), fd(-1), log(nullptr), song(0), frameBytes(0), rate(0),
+      start(0), frames(0)
+{
+}
+
+FileOutput::~FileOutput()
+{
+    close();
+}
+
+/*
+ * open -- Accept the requested format as is, songs are appended to the file.
+ */
+bool
+FileOutput::open(DeviceFormat *dev)
+{
+    int sampleBytes = SampleBytes(dev->format);
+
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        perror("open output file");
+        return false;
+    }
+
+    log = fopen((path + ".log").c_str(), "a");
+    if (log == nullptr) {
+        perror("open output log");
+        close();
+        return false;
+    }
+    // Readers watch the log to see playback progress
+    setvbuf(log, nullptr, _IOLBF, 0);
+
+    song++;
+    frameBytes = sampleBytes * dev->channels;
+    rate = dev->rate;
+    start = 0;
+    frames = 0;
+
+    return true;
+}
+
+/*
+ * write -- Wait until the first sample of buf is due, as a device with no
+ * buffering would play it, then log and store it.  The log line is
+ * "song frame monotonic_ns".  Writes more than 10 ms late find the device run
+ * dry, after a PAUSE say, and play from now on.
+ */
+bool
+FileOutput::write(const void *buf, size_t len)
+{
+    struct timespec tp;
+    int64_t due;
+    int64_t now;
+
+    now = ClockNowNS();
+    if (frames == 0)
+        start = now;
+
+    due = start + frames * 1000000000 / rate;
+    if (now - due > 10000000) {
+        start = now - frames * 1000000000 / rate;
+        due = now;
+    }
+    if (due > now)
+        usleep((due - now) / 1000);
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    fprintf(log, "%d %lld %lld\n", song, (long long)frames,
+            (long long)tp.tv_sec * 1000000000 + tp.tv_nsec);
+
+    if (::write(fd, buf, len) < 0) {
+        perror("write output file");
+        return false;
+    }
+    frames += len / frameBytes;
+
+    return true;
+}
+
+void
+FileOutput::close()
+{
+    if (log != nullptr) {
+        fclose(log);
+        log = nullptr;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
@@ -0,0 +1,114 @@
+
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+#include <string>
+
+#include "resample.h"
+
+#define OUTPUT_DEFAULT  "/dev/dsp0.0"
+#define OUTPUT_FILE     "file:"
+
+#define OUTPUT_PROFILE  "/var/db/speakerd.latency"
+
+#define OUTPUT_LATENCY      50      // Default target buffer (ms)
+#define OSS_FRAGMENTS       4       // Fragments in the device buffer
+#define OSS_MIN_FRAGSHIFT   7       // Smallest fragment, 128 bytes
+
+#define LOOPBACK_RUNS       5       // Measurements, the median is kept
+#define LOOPBACK_LEAD       20      // Silence before the click (ms)
+#define LOOPBACK_CLICK      1       // Click length (ms)
+#define LOOPBACK_RECORD     500     // Longest round trip we look for (ms)
+#define LOOPBACK_MIN_LEVEL  1000    // Smallest click level we accept
+
+/*
+ * Output latency profile, how long each device takes from write() to sound
+ * (us), keyed by output spec.
+ */
+typedef std::map<std::string, int64_t> LatencyProfile;
+
+bool LoadLatencyProfile(const std::string &path, LatencyProfile *profile);
+bool SaveLatencyProfile(const std::string &path, const LatencyProfile &profile);
+
+/*
+ * AudioOutput -- Where decoded PCM goes.  open() is passed the format we would
+ * like and returns the one the output settled on.  getLatency() is the most
+ * that can be buffered in microseconds.  measureLatency() finds the device's
+ * own output delay where the hardware can loop its output back.
+ */
+class AudioOutput
+{
+public:
+    virtual ~AudioOutput() { }
+    virtual bool open(DeviceFormat *dev) = 0;
+    virtual bool write(const void *buf, size_t len) = 0;
+    virtual void close() = 0;
+    virtual int64_t getLatency() { return 0; }
+    virtual bool measureLatency(DeviceFormat *dev, int64_t *latency)
+    {
+        return false;
+    }
+    static AudioOutput *create(const char *spec, int latencyMs);
+};
+
+/*
+ * OSSOutput -- Open Sound System device with a bounded buffer.  Writes are
+ * non-blocking and wait in poll() for room, giving up on a device that has
+ * not taken anything for the length of the whole buffer plus 100ms.
+ */
+class OSSOutput : public AudioOutput
+{
+public:
+    OSSOutput(const char *path, int latencyMs);
+    ~OSSOutput() override;
+    bool open(DeviceFormat *dev) override;
+    bool write(const void *buf, size_t len) override;
+    void close() override;
+    int64_t getLatency() override;
+    bool measureLatency(DeviceFormat *dev, int64_t *latency) override;
+private:
+    int64_t getDelay();
+    void setFragments(const DeviceFormat &dev);
+    bool measureOnce(const DeviceFormat &dev, int64_t *roundTrip);
+    void checkUnderrun();
+    std::string path;
+    int latencyMs;      // Target buffer, 0 for the driver default
+    int fd;
+    int bytesPerSec;
+    int bufferBytes;
+    bool started;
+    int underruns;
+    int64_t maxDelay;
+};
+
+/*
+ * FileOutput -- Writes PCM to a file at the rate a device would play it,
+ * following the local (possibly skewed) clock.  Each write is logged to
+ * PATH.log with the CLOCK_MONOTONIC time its first sample leaves, so runs of
+ * several instances on one host can be compared sample for sample.
+ */
+class FileOutput : public AudioOutput
+{
+public:
+    FileOutput(const char *path);
+    ~FileOutput() override;
+    bool open(DeviceFormat *dev) override;
+    bool write(const void *buf, size_t len) override;
+    void close() override;
+private:
+    std::string path;
+    int fd;
+    FILE *log;
+    int song;           // Opens so far
+    int frameBytes;
+    int rate;
+    int64_t start;      // Local time of the first sample (ns)
+    int64_t frames;     // Frames written since open
+};
+
+#endif /* __OUTPUT_H__ */
+
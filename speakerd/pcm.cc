@@ -0,0 +1,435 @@
+/*
+ * PCM Processing Stage
+ *
+ * Sits between the AAC decoder and the sound device.  Each speaker applies its
+ * own volume, picks which part of the stereo image it reproduces and folds any
+ * multichannel layout down to the device channels.
+ *
+ * All three steps are linear so they collapse into one small matrix:
+ *
+ *   out = gain * ChannelMap * Downmix * in
+ *
+ * The matrix is kept in Q14 fixed point.  A stereo source on a stereo device
+ * needs just two multiply-adds per output sample which maps directly onto
+ * pmaddwd (SSE2/AVX2) and vmlal (NEON).  Packing back to 16 bits saturates.
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include <iostream>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "pcm.h"
+
+using namespace std;
+
+#define PCM_Q           14
+#define PCM_ONE         (1 << PCM_Q)
+#define PCM_ROUND       (1 << (PCM_Q - 1))
+#define PCM_MAX_GAIN_DB 6.0
+
+typedef void (*Mix2x2Fn)(const int16_t *in, int16_t *out, size_t frames,
+                         const int16_t coef[2][PCM_MAX_CHANNELS]);
+
+static inline int16_t
+Saturate(int32_t v)
+{
+    if (v > INT16_MAX)
+        return INT16_MAX;
+    if (v < INT16_MIN)
+        return INT16_MIN;
+    return (int16_t)v;
+}
+
+/*
+ * MixScalar -- Generic N to M channel matrix.
+ *
+ * Both outputs of a frame are computed before either is stored so the output
+ * may alias the input as long as it has no more channels.
+ */
+static void
+MixScalar(const int16_t *in, int16_t *out, size_t frames, int inCh, int outCh,
+          const int16_t coef[2][PCM_MAX_CHANNELS])
+{
+    for (size_t f = 0; f < frames; f++) {
+        int32_t acc[2] = { PCM_ROUND, PCM_ROUND };
+
+        for (int o = 0; o < outCh; o++) {
+            for (int c = 0; c < inCh; c++) {
+                acc[o] += (int32_t)coef[o][c] * in[c];
+            }
+        }
+        for (int o = 0; o < outCh; o++) {
+            out[o] = Saturate(acc[o] >> PCM_Q);
+        }
+
+        in += inCh;
+        out += outCh;
+    }
+}
+
+#if !defined(__SSE2__) && !defined(__ARM_NEON)
+static void
+Mix2x2Scalar(const int16_t *in, int16_t *out, size_t frames,
+             const int16_t coef[2][PCM_MAX_CHANNELS])
+{
+    MixScalar(in, out, frames, 2, 2, coef);
+}
+#endif
+
+#if defined(__SSE2__)
+static void
+Mix2x2SSE2(const int16_t *in, int16_t *out, size_t frames,
+           const int16_t coef[2][PCM_MAX_CHANNELS])
+{
+    size_t i = 0;
+    const __m128i cl = _mm_set1_epi32((uint16_t)coef[0][0] |
+                                      ((uint32_t)(uint16_t)coef[0][1] << 16));
+    const __m128i cr = _mm_set1_epi32((uint16_t)coef[1][0] |
+                                      ((uint32_t)(uint16_t)coef[1][1] << 16));
+    const __m128i rnd = _mm_set1_epi32(PCM_ROUND);
+
+    // 4 frames per iteration: L' = a*L + b*R, R' = c*L + d*R
+    for (; i + 4 <= frames; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + 2 * i));
+        __m128i l = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(v, cl), rnd),
+                                   PCM_Q);
+        __m128i r = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(v, cr), rnd),
+                                   PCM_Q);
+        __m128i lo = _mm_unpacklo_epi32(l, r);
+        __m128i hi = _mm_unpackhi_epi32(l, r);
+
+        _mm_storeu_si128((__m128i *)(out + 2 * i), _mm_packs_epi32(lo, hi));
+    }
+
+    MixScalar(in + 2 * i, out + 2 * i, frames - i, 2, 2, coef);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Built for AVX2 regardless of the compiler flags and only selected when the
+ * CPU reports support, so one binary serves old and new speaker hosts.
+ * unpack and pack both operate within 128-bit lanes which keeps the frames in
+ * order without a cross-lane permute.
+ */
+__attribute__((target("avx2")))
+static void
+Mix2x2AVX2(const int16_t *in, int16_t *out, size_t frames,
+           const int16_t coef[2][PCM_MAX_CHANNELS])
+{
+    size_t i = 0;
+    const __m256i cl = _mm256_set1_epi32((uint16_t)coef[0][0] |
+                                         ((uint32_t)(uint16_t)coef[0][1] << 16));
+    const __m256i cr = _mm256_set1_epi32((uint16_t)coef[1][0] |
+                                         ((uint32_t)(uint16_t)coef[1][1] << 16));
+    const __m256i rnd = _mm256_set1_epi32(PCM_ROUND);
+
+    for (; i + 8 <= frames; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + 2 * i));
+        __m256i l = _mm256_srai_epi32(
+                _mm256_add_epi32(_mm256_madd_epi16(v, cl), rnd), PCM_Q);
+        __m256i r = _mm256_srai_epi32(
+                _mm256_add_epi32(_mm256_madd_epi16(v, cr), rnd), PCM_Q);
+        __m256i lo = _mm256_unpacklo_epi32(l, r);
+        __m256i hi = _mm256_unpackhi_epi32(l, r);
+
+        _mm256_storeu_si256((__m256i *)(out + 2 * i),
+                            _mm256_packs_epi32(lo, hi));
+    }
+
+    MixScalar(in + 2 * i, out + 2 * i, frames - i, 2, 2, coef);
+}
+#endif
+
+#if defined(__ARM_NEON)
+static void
+Mix2x2NEON(const int16_t *in, int16_t *out, size_t frames,
+           const int16_t coef[2][PCM_MAX_CHANNELS])
+{
+    size_t i = 0;
+
+    for (; i + 8 <= frames; i += 8) {
+        int16x8x2_t v = vld2q_s16(in + 2 * i);
+        int16x8x2_t o;
+        int32x4_t llo, lhi, rlo, rhi;
+
+        llo = vmull_n_s16(vget_low_s16(v.val[0]), coef[0][0]);
+        llo = vmlal_n_s16(llo, vget_low_s16(v.val[1]), coef[0][1]);
+        lhi = vmull_n_s16(vget_high_s16(v.val[0]), coef[0][0]);
+        lhi = vmlal_n_s16(lhi, vget_high_s16(v.val[1]), coef[0][1]);
+        rlo = vmull_n_s16(vget_low_s16(v.val[0]), coef[1][0]);
+        rlo = vmlal_n_s16(rlo, vget_low_s16(v.val[1]), coef[1][1]);
+        rhi = vmull_n_s16(vget_high_s16(v.val[0]), coef[1][0]);
+        rhi = vmlal_n_s16(rhi, vget_high_s16(v.val[1]), coef[1][1]);
+
+        // Rounding, saturating narrow back to 16 bits
+        o.val[0] = vcombine_s16(vqrshrn_n_s32(llo, PCM_Q),
+                                vqrshrn_n_s32(lhi, PCM_Q));
+        o.val[1] = vcombine_s16(vqrshrn_n_s32(rlo, PCM_Q),
+                                vqrshrn_n_s32(rhi, PCM_Q));
+        vst2q_s16(out + 2 * i, o);
+    }
+
+    MixScalar(in + 2 * i, out + 2 * i, frames - i, 2, 2, coef);
+}
+#endif
+
+static Mix2x2Fn
+SelectMix2x2()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return Mix2x2AVX2;
+#endif
+#if defined(__SSE2__)
+    return Mix2x2SSE2;
+#elif defined(__ARM_NEON)
+    return Mix2x2NEON;
+#else
+    return Mix2x2Scalar;
+#endif
+}
+
+static Mix2x2Fn Mix2x2 = SelectMix2x2();
+
+bool
+ParseChannelMap(const char *str, ChannelMap *map)
+{
+    static const struct {
+        const char *name;
+        ChannelMap map;
+    } maps[] = {
+        { "stereo", CHMAP_STEREO },
+        { "swap", CHMAP_SWAP },
+        { "left", CHMAP_LEFT },
+        { "right", CHMAP_RIGHT },
+        { "mono", CHMAP_MONO },
+    };
+
+    for (auto &&m : maps) {
+        if (strcmp(str, m.name) == 0) {
+            *map = m.map;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+PcmProcessor::PcmProcessor()
+    : gain(1.0), chanmap(CHMAP_STEREO), inChannels(2), outChannels(2),
+      identity(true), layout(), coef()
+{
+    layout[0] = PCM_POS_LEFT;
+    layout[1] = PCM_POS_RIGHT;
+    rebuild();
+}
+
+PcmProcessor::~PcmProcessor()
+{
+}
+
+void
+PcmProcessor::setGain(double db)
+{
+    if (db > PCM_MAX_GAIN_DB) {
+        cout << "Gain clamped to " << PCM_MAX_GAIN_DB << " dB" << endl;
+        db = PCM_MAX_GAIN_DB;
+    }
+
+    gain = pow(10.0, db / 20.0);
+    rebuild();
+}
+
+void
+PcmProcessor::setChannelMap(ChannelMap map)
+{
+    chanmap = map;
+    rebuild();
+}
+
+void
+PcmProcessor::setOutputChannels(int channels)
+{
+    outChannels = (channels == 1) ? 1 : 2;
+    rebuild();
+}
+
+/*
+ * setInputLayout -- Describe the decoder output.  Cheap to call on every
+ * frame, the matrix is only rebuilt when the layout actually changes.
+ */
+void
+PcmProcessor::setInputLayout(int channels, const PcmPosition *l)
+{
+    if (channels < 1 || channels > PCM_MAX_CHANNELS) {
+        cout << "Unsupported channel count " << channels << endl;
+        return;
+    }
+
+    if (channels == inChannels &&
+        memcmp(layout, l, sizeof(*l) * channels) == 0) {
+        return;
+    }
+
+    inChannels = channels;
+    memcpy(layout, l, sizeof(*l) * channels);
+    rebuild();
+}
+
+int
+PcmProcessor::getInputChannels()
+{
+    return inChannels;
+}
+
+int
+PcmProcessor::getOutputChannels()
+{
+    return outChannels;
+}
+
+void
+PcmProcessor::rebuild()
+{
+    double downmix[2][PCM_MAX_CHANNELS];
+    double map[2][2];
+    double norm = 0.0;
+
+    // Fold every input channel onto a stereo pair (ITU-R BS.775 weights)
+    for (int c = 0; c < inChannels; c++) {
+        double l = 0.0, r = 0.0;
+
+        switch (layout[c]) {
+            case PCM_POS_LEFT:
+                l = 1.0;
+                break;
+            case PCM_POS_RIGHT:
+                r = 1.0;
+                break;
+            case PCM_POS_CENTER:
+                l = r = M_SQRT1_2;
+                break;
+            case PCM_POS_SURROUND_LEFT:
+                l = M_SQRT1_2;
+                break;
+            case PCM_POS_SURROUND_RIGHT:
+                r = M_SQRT1_2;
+                break;
+            case PCM_POS_LFE:
+                break;
+            case PCM_POS_OTHER:
+                l = r = 0.5;
+                break;
+        }
+        if (inChannels == 1) {
+            l = r = 1.0;
+        }
+
+        downmix[0][c] = l;
+        downmix[1][c] = r;
+    }
+
+    // Keep a full scale multichannel mix from clipping
+    for (int o = 0; o < 2; o++) {
+        double sum = 0.0;
+        for (int c = 0; c < inChannels; c++) {
+            sum += downmix[o][c];
+        }
+        if (sum > norm) {
+            norm = sum;
+        }
+    }
+    if (norm < 1.0) {
+        norm = 1.0;
+    }
+
+    switch (chanmap) {
+        case CHMAP_STEREO:
+            map[0][0] = 1.0; map[0][1] = 0.0;
+            map[1][0] = 0.0; map[1][1] = 1.0;
+            break;
+        case CHMAP_SWAP:
+            map[0][0] = 0.0; map[0][1] = 1.0;
+            map[1][0] = 1.0; map[1][1] = 0.0;
+            break;
+        case CHMAP_LEFT:
+            map[0][0] = 1.0; map[0][1] = 0.0;
+            map[1][0] = 1.0; map[1][1] = 0.0;
+            break;
+        case CHMAP_RIGHT:
+            map[0][0] = 0.0; map[0][1] = 1.0;
+            map[1][0] = 0.0; map[1][1] = 1.0;
+            break;
+        case CHMAP_MONO:
+            map[0][0] = 0.5; map[0][1] = 0.5;
+            map[1][0] = 0.5; map[1][1] = 0.5;
+            break;
+    }
+    if (outChannels == 1 && (chanmap == CHMAP_STEREO || chanmap == CHMAP_SWAP)) {
+        map[0][0] = 0.5;
+        map[0][1] = 0.5;
+    }
+
+    memset(coef, 0, sizeof(coef));
+    for (int o = 0; o < outChannels; o++) {
+        for (int c = 0; c < inChannels; c++) {
+            double v = gain * (map[o][0] * downmix[0][c] +
+                               map[o][1] * downmix[1][c]) / norm;
+            long q = lround(v * PCM_ONE);
+
+            if (q > INT16_MAX)
+                q = INT16_MAX;
+            if (q < INT16_MIN)
+                q = INT16_MIN;
+            coef[o][c] = (int16_t)q;
+        }
+    }
+
+    identity = (inChannels == outChannels);
+    for (int o = 0; o < outChannels && identity; o++) {
+        for (int c = 0; c < inChannels; c++) {
+            if (coef[o][c] != ((o == c) ? PCM_ONE : 0)) {
+                identity = false;
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * process -- Convert frames of interleaved input into interleaved output.
+ *
+ * out may alias in when the output has no more channels than the input.
+ * Returns the number of bytes written to out.
+ */
+size_t
+PcmProcessor::process(const int16_t *in, int16_t *out, size_t frames)
+{
+    size_t len = frames * outChannels * sizeof(int16_t);
+
+    if (identity) {
+        if (in != out) {
+            memmove(out, in, len);
+        }
+    } else if (inChannels == 2 && outChannels == 2) {
+        Mix2x2(in, out, frames, coef);
+    } else {
+        MixScalar(in, out, frames, inChannels, outChannels, coef);
+    }
+
+    return len;
+}
+
@@ -0,0 +1,70 @@
+
+#ifndef __PCM_H__
+#define __PCM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PCM_MAX_CHANNELS    8
+
+/*
+ * Speaker position of each decoded channel, used to build the downmix.
+ */
+enum PcmPosition
+{
+    PCM_POS_LEFT,
+    PCM_POS_RIGHT,
+    PCM_POS_CENTER,
+    PCM_POS_LFE,
+    PCM_POS_SURROUND_LEFT,
+    PCM_POS_SURROUND_RIGHT,
+    PCM_POS_OTHER,
+};
+
+/*
+ * Which part of the stereo image this speaker reproduces.
+ */
+enum ChannelMap
+{
+    CHMAP_STEREO,   // Left to left, right to right
+    CHMAP_SWAP,     // Left and right exchanged
+    CHMAP_LEFT,     // Left channel on every output
+    CHMAP_RIGHT,    // Right channel on every output
+    CHMAP_MONO,     // (L + R) / 2 on every output
+};
+
+bool ParseChannelMap(const char *str, ChannelMap *map);
+
+/*
+ * PcmProcessor -- Per-speaker gain, channel mapping and downmix.
+ *
+ * Gain, channel map and downmix are folded into a single Q14 matrix that is
+ * rebuilt only when the input layout changes.  Samples are signed 16-bit
+ * interleaved and the result saturates instead of wrapping.  The common stereo
+ * to stereo case runs through SSE2/AVX2/NEON kernels.
+ */
+class PcmProcessor
+{
+public:
+    PcmProcessor();
+    ~PcmProcessor();
+    void setGain(double db);
+    void setChannelMap(ChannelMap map);
+    void setOutputChannels(int channels);
+    void setInputLayout(int channels, const PcmPosition *layout);
+    int getInputChannels();
+    int getOutputChannels();
+    size_t process(const int16_t *in, int16_t *out, size_t frames);
+private:
+    void rebuild();
+    double gain;
+    ChannelMap chanmap;
+    int inChannels;
+    int outChannels;
+    bool identity;
+    PcmPosition layout[PCM_MAX_CHANNELS];
+    int16_t coef[2][PCM_MAX_CHANNELS];
+};
+
+#endif /* __PCM_H__ */
+
@@ -0,0 +1,292 @@
+/*
+ * Performance Counters
+ *
+ * PERF builds wrap the hot regions of speakerd in PERF_REGION().  Every thread
+ * opens one perf_event_open() group the first time it enters a region,
+ * counting user space cycles, instructions and cache misses of that thread,
+ * and reads the whole group with a single read() as a region starts and ends.
+ * Context switches come from getrusage().  The differences are added to the
+ * totals of the region, regions on several threads and nested regions simply
+ * add up.
+ *
+ * perf_event_open() is Linux only.  Elsewhere, or where the kernel refuses
+ * hardware counters (perf_event_paranoid, most virtual machines), a region
+ * still records calls, time and context switches.
+ *
+ * The table is printed at exit, on SIGUSR1 and on SIGINT or SIGTERM just
+ * before speakerd exits.
+ */
+
+#ifdef CELESTIS_PERF
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#include <atomic>
+#include <thread>
+
+#include "perf.h"
+
+using namespace std;
+
+enum
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHEMISSES,
+    PERF_CSW,
+};
+
+struct PerfTotals
+{
+    atomic<uint64_t> calls;
+    atomic<uint64_t> counted;   // Calls with hardware counters
+    atomic<uint64_t> ns;
+    atomic<uint64_t> counts[PERF_COUNTERS];
+};
+
+static PerfTotals totals[PERF_REGIONS];
+
+static const char *regionNames[PERF_REGIONS] = {
+    "decode",
+    "write",
+    "processPkt",
+    "getTime",
+    "load read",
+};
+
+/*
+ * PerfGroup -- Counter group of one thread, fds[0] leads, closed when the
+ * thread exits.
+ */
+struct PerfGroup
+{
+    int fds[PERF_CSW] = { -1, -1, -1 };
+    bool tried = false;
+
+    ~PerfGroup()
+    {
+        close();
+    }
+
+    void close()
+    {
+        for (auto &&fd : fds) {
+            if (fd >= 0)
+                ::close(fd);
+            fd = -1;
+        }
+    }
+};
+
+static thread_local PerfGroup group;
+static atomic<bool> warned(false);
+
+#ifdef __linux__
+static int
+PerfOpen(uint64_t config, int leader)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+}
+
+/*
+ * PerfOpenGroup -- Count cycles, instructions and cache misses of the calling
+ * thread in one group.  Returns false if the kernel will not count them.
+ */
+static bool
+PerfOpenGroup(PerfGroup *g)
+{
+    static const uint64_t events[PERF_CSW] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+    };
+
+    for (int i = 0; i < PERF_CSW; i++) {
+        g->fds[i] = PerfOpen(events[i], g->fds[0]);
+        if (g->fds[i] < 0) {
+            // Once, not for every thread
+            if (!warned.exchange(true))
+                perror("perf_event_open, counting time and context "
+                       "switches only");
+            g->close();
+            return false;
+        }
+    }
+
+    return true;
+}
+#endif
+
+/*
+ * PerfRead -- Current counts of the calling thread.  Returns false if only
+ * the context switches could be read.
+ */
+static bool
+PerfRead(uint64_t counts[PERF_COUNTERS])
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_THREAD, &ru);
+    counts[PERF_CSW] = ru.ru_nvcsw + ru.ru_nivcsw;
+
+#ifdef __linux__
+    uint64_t buf[1 + PERF_CSW];    // nr, then one value per counter
+
+    if (!group.tried) {
+        group.tried = true;
+        PerfOpenGroup(&group);
+    }
+    if (group.fds[0] >= 0 &&
+        read(group.fds[0], buf, sizeof(buf)) == sizeof(buf)) {
+        for (int i = 0; i < PERF_CSW; i++) {
+            counts[i] = buf[1 + i];
+        }
+        return true;
+    }
+#endif
+
+    return false;
+}
+
+static int64_t
+PerfNow()
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (int64_t)tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+PerfRegion::PerfRegion(PerfRegionId id)
+    : id(id), start(0), hw(false), counts()
+{
+    hw = PerfRead(counts);
+    start = PerfNow();
+}
+
+PerfRegion::~PerfRegion()
+{
+    uint64_t end[PERF_COUNTERS];
+    int64_t ns = PerfNow() - start;
+    bool ok = PerfRead(end) && hw;
+    PerfTotals &t = totals[id];
+
+    t.calls++;
+    t.ns += ns;
+    t.counts[PERF_CSW] += end[PERF_CSW] - counts[PERF_CSW];
+    if (ok) {
+        t.counted++;
+        for (int i = 0; i < PERF_CSW; i++) {
+            t.counts[i] += end[i] - counts[i];
+        }
+    }
+}
+
+/*
+ * PerfDump -- Print per call averages of every region that ran.
+ */
+void
+PerfDump(FILE *out)
+{
+    fprintf(out, "%-12s %10s %10s %12s %12s %6s %10s %8s\n", "region",
+            "calls", "us/call", "cycles/call", "instr/call", "IPC",
+            "miss/call", "csw/call");
+
+    for (int r = 0; r < PERF_REGIONS; r++) {
+        PerfTotals &t = totals[r];
+        uint64_t calls = t.calls;
+        uint64_t counted = t.counted;
+
+        if (calls == 0)
+            continue;
+
+        fprintf(out, "%-12s %10llu %10.2f ", regionNames[r],
+                (unsigned long long)calls, (double)t.ns / calls / 1000);
+        if (counted > 0) {
+            double cycles = t.counts[PERF_CYCLES];
+            double instructions = t.counts[PERF_INSTRUCTIONS];
+
+            fprintf(out, "%12.0f %12.0f %6.2f %10.1f ", cycles / counted,
+                    instructions / counted,
+                    cycles > 0 ? instructions / cycles : 0.0,
+                    (double)t.counts[PERF_CACHEMISSES] / counted);
+        } else {
+            fprintf(out, "%12s %12s %6s %10s ", "-", "-", "-", "-");
+        }
+        fprintf(out, "%8.3f\n", (double)t.counts[PERF_CSW] / calls);
+    }
+    fflush(out);
+}
+
+static void
+PerfAtExit()
+{
+    PerfDump(stdout);
+}
+
+/*
+ * PerfSignals -- Print the table on SIGUSR1, print it and exit on SIGINT and
+ * SIGTERM.
+ */
+static void
+PerfSignals()
+{
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+
+    for (;;) {
+        if (sigwait(&set, &sig) != 0)
+            continue;
+        PerfDump(stdout);
+        if (sig != SIGUSR1)
+            _exit(128 + sig);
+    }
+}
+
+/*
+ * PerfInit -- Set up the dumps.  Call before starting any other thread, they
+ * inherit the blocked signals so that only PerfSignals() sees them.
+ */
+void
+PerfInit()
+{
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+    thread(PerfSignals).detach();
+    atexit(PerfAtExit);
+
+    printf("PERF build, send SIGUSR1 for counters\n");
+}
+
+#endif /* CELESTIS_PERF */
+
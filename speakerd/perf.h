@@ -0,0 +1,61 @@
+
+#ifndef __PERF_H__
+#define __PERF_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Hot regions counted in PERF builds (BUILDTYPE=PERF, -DCELESTIS_PERF).
+ */
+enum PerfRegionId
+{
+    PERF_DECODE,        // One AAC frame through the decoder
+    PERF_WRITE,         // One write to an output device
+    PERF_PROCESSPKT,    // One time sync packet
+    PERF_GETTIME,       // Cluster time lookup
+    PERF_LOADREAD,      // One read() of a LOAD
+    PERF_REGIONS,
+};
+
+#ifdef CELESTIS_PERF
+
+// Cycles, instructions, cache misses and context switches
+#define PERF_COUNTERS   4
+
+/*
+ * PerfRegion -- Counts the hardware events of the calling thread from
+ * construction to destruction and adds them to the region's totals.
+ */
+class PerfRegion
+{
+public:
+    PerfRegion(PerfRegionId id);
+    ~PerfRegion();
+    PerfRegion(const PerfRegion &) = delete;
+    PerfRegion &operator=(const PerfRegion &) = delete;
+private:
+    PerfRegionId id;
+    int64_t start;
+    bool hw;                        // Hardware counters were read
+    uint64_t counts[PERF_COUNTERS];
+};
+
+#define PERF_REGION(_id)    PerfRegion __perfRegion(_id)
+
+void PerfInit();
+void PerfDump(FILE *out);
+
+#else /* CELESTIS_PERF */
+
+#define PERF_REGION(_id)
+
+static inline void
+PerfInit()
+{
+}
+
+#endif /* CELESTIS_PERF */
+
+#endif /* __PERF_H__ */
+
@@ -0,0 +1,757 @@
+/*
+ * Song Player
+ *
+ * LOAD fills a free song slot while another song may still be playing from
+ * the other one.  PLAY queues the most recently loaded song with its start
+ * time and the player thread works through the queue in order, sleeping until
+ * each start time.  A slot is only reused once nothing references it.
+ *
+ * A speaker that restarts or joins late is sent the current song with its
+ * original start time.  Rather than decode from the beginning to catch up, the
+ * player picks a join time just ahead of now, seeks to the frame playing at
+ * that time using the song's frame index and starts there.
+ *
+ * The decoder thread decodes each song once into a PcmFanout, running up to
+ * FANOUT_CHUNKS frames ahead of playback.  Every output thread opens its
+ * device when a song starts, waits for the start time less its latency
+ * offset and then processes and writes each frame.  All outputs play the same
+ * decoded samples and stay sample aligned.
+ *
+ * PAUSE, RESUME and SEEK are recorded as events against the current song and
+ * every output applies them to its own stream.  An output keeps track of the
+ * cluster time of each sample it writes, so it writes up to the sample due at
+ * an event and then acts on it.  On PAUSE it stops writing, the device plays
+ * out what it holds and the ring stays full of decoded frames, so a RESUME
+ * continues without a gap to refill.  A SEEK bumps the chunk generation: the
+ * decoder stops at the sample the SEEK replaces, seeks with the frame index
+ * and carries on from there, outputs skip whatever is left of the old
+ * generation.  The decoder keeps the song until every output is done with it
+ * so that a SEEK can always go back to it, unless the next song is due first.
+ * A paused song holds back the songs queued behind it until it has played out.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "config.h"
+#include "perf.h"
+#include "player.h"
+#include "realtime.h"
+#include "resample.h"
+#include "speaker.h"
+
+using namespace std;
+
+static char songbuf[SONG_SLOTS][SONG_LEN];
+
+Player::Player(TimeSync *ts, const vector<OutputConfig> &outputConfigs)
+    : ts(ts), fanout(outputConfigs.size()), outputs(), latency(0),
+      prepared(0), preroll(0), done(false),
+      thr(nullptr), lock(), cv(), slots(), last(nullptr), queue(),
+      lastEnd(0), current(nullptr), serial(0), pending(0), curStart(0), curPosition(0),
+      gen(0), decGen(0),
+      events(), outputsDone(0), stopAt(INT64_MAX)
+{
+    for (int i = 0; i < SONG_SLOTS; i++) {
+        slots[i].buf = songbuf[i];
+        slots[i].len = 0;
+        slots[i].refs = 0;
+    }
+
+    for (auto &&c : outputConfigs) {
+        Output *o = new Output();
+
+        o->id = outputs.size();
+        o->config = c;
+        o->dev = AudioOutput::create(c.device.c_str(), c.latency);
+        o->thr = nullptr;
+        o->proc.setGain(c.gain);
+        o->proc.setChannelMap(c.chanmap);
+        o->pcm.resize(FANOUT_MAX_FRAMES * 2);
+        outputs.push_back(o);
+
+        if (c.delay > latency)
+            latency = c.delay;
+    }
+}
+
+Player::~Player()
+{
+    if (thr != nullptr)
+        stop();
+    for (auto &&o : outputs) {
+        delete o->dev;
+        delete o;
+    }
+}
+
+void
+Player::start()
+{
+    done = false;
+    thr = new thread(&Player::run, this);
+    for (auto &&o : outputs) {
+        o->thr = new thread(&Player::runOutput, this, o);
+    }
+}
+
+void
+Player::stop()
+{
+    {
+        lock_guard<mutex> lk(lock);
+        done = true;
+    }
+    cv.notify_all();
+    fanout.shutdown();
+
+    thr->join();
+    delete thr;
+    thr = nullptr;
+
+    for (auto &&o : outputs) {
+        o->thr->join();
+        delete o->thr;
+        o->thr = nullptr;
+    }
+}
+
+/*
+ * prefault -- Back all song slots and PCM buffers with memory, see
+ * RTPrefault().
+ */
+void
+Player::prefault()
+{
+    for (int i = 0; i < SONG_SLOTS; i++) {
+        RTPrefault(slots[i].buf, SONG_LEN);
+    }
+    fanout.prefault();
+    for (auto &&o : outputs) {
+        RTPrefault(o->pcm.data(), o->pcm.size() * sizeof(int16_t));
+    }
+}
+
+/*
+ * acquire -- Pick a slot for the next LOAD.  Prefer one that is neither
+ * scheduled nor holding the last loaded song, wait if every slot is in use.
+ */
+Song *
+Player::acquire()
+{
+    unique_lock<mutex> lk(lock);
+
+    for (;;) {
+        Song *idle = nullptr;
+
+        for (auto &&s : slots) {
+            if (s.refs != 0)
+                continue;
+            if (&s != last)
+                return &s;
+            idle = &s;
+        }
+
+        if (idle != nullptr) {
+            last = nullptr;
+            return idle;
+        }
+
+        cv.wait(lk);
+    }
+}
+
+/*
+ * loaded -- LOAD into s finished, make it the song the next PLAY refers to.
+ */
+void
+Player::loaded(Song *s, bool ok)
+{
+    lock_guard<mutex> lk(lock);
+
+    if (ok) {
+        last = s;
+    } else {
+        s->len = 0;
+        if (last == s)
+            last = nullptr;
+    }
+}
+
+/*
+ * play -- Queue the last loaded song to start at timestamp (cluster time).
+ */
+bool
+Player::play(int64_t timestamp)
+{
+    int64_t now = ts->getTime();
+    lock_guard<mutex> lk(lock);
+
+    if (last == nullptr) {
+        printf("PLAY without a loaded song\n");
+        return false;
+    }
+
+    // Outputs start up to latency early, too late for any of them is late
+    last->refs++;
+    queue.push_back({ last, timestamp, timestamp - latency < now });
+    cv.notify_all();
+
+    return true;
+}
+
+/*
+ * pause -- Stop the current song at cluster time at.
+ */
+bool
+Player::pause(int64_t at)
+{
+    return control({PLAYER_PAUSE, at, 0, 0, 0});
+}
+
+/*
+ * resume -- Continue a paused song at cluster time at.
+ */
+bool
+Player::resume(int64_t at)
+{
+    return control({PLAYER_RESUME, at, 0, 0, 0});
+}
+
+/*
+ * seek -- Play the current song from position (us into the song) at cluster
+ * time at, resuming it if paused.
+ */
+bool
+Player::seek(int64_t at, int64_t position)
+{
+    return control({PLAYER_SEEK, at, position, 0, 0});
+}
+
+/*
+ * control -- Add ev to the events of the current song.  Events must be in time
+ * order and far enough out that no output has written past them yet.
+ */
+bool
+Player::control(Event ev)
+{
+    int64_t now = ts->getTime();
+
+    {
+        lock_guard<mutex> lk(lock);
+
+        if (current == nullptr) {
+            printf("Control: no song playing\n");
+            return false;
+        }
+        if (pending > 0) {
+            printf("Control: the previous song is still playing\n");
+            return false;
+        }
+        if (ev.at < now + latency + PLAYER_JOIN_LEAD) {
+            printf("Control: %lld us too late\n",
+                   (long long)(now + latency + PLAYER_JOIN_LEAD - ev.at));
+            return false;
+        }
+        if (ev.at < curStart || (!events.empty() && ev.at < events.back().at)) {
+            printf("Control: out of order\n");
+            return false;
+        }
+
+        if (ev.action == PLAYER_SEEK) {
+            ev.position = ev.position * current->index.getRate() / 1000000;
+            ev.cut = positionAt(ev.at);
+            ev.gen = ++gen;
+            if (ev.gen == decGen + 1)
+                stopAt = ev.cut;
+        }
+        events.push_back(ev);
+    }
+    cv.notify_all();
+
+    return true;
+}
+
+/*
+ * segment -- Fold the events so far: song sample segP plays at cluster time
+ * segT, or is where the song stays if paused.  Called with the lock held.
+ */
+void
+Player::segment(int64_t *segT, int64_t *segP, bool *paused)
+{
+    int64_t rate = current->index.getRate();
+
+    *segT = curStart;
+    *segP = curPosition;
+    *paused = false;
+
+    for (auto &&e : events) {
+        switch (e.action) {
+            case PLAYER_PAUSE:
+                if (!*paused)
+                    *segP += (e.at - *segT) * rate / 1000000;
+                *paused = true;
+                break;
+            case PLAYER_RESUME:
+                if (*paused)
+                    *segT = e.at;
+                *paused = false;
+                break;
+            case PLAYER_SEEK:
+                *segT = e.at;
+                *segP = e.position;
+                *paused = false;
+                break;
+        }
+    }
+}
+
+/*
+ * positionAt -- The song sample due at cluster time at after the events so
+ * far.  Uses the same arithmetic as the outputs so the decoder cuts a SEEK on
+ * the sample they expect.  Called with the lock held.
+ */
+int64_t
+Player::positionAt(int64_t at)
+{
+    int64_t rate = current->index.getRate();
+    int64_t segT, segP;
+    bool paused;
+
+    segment(&segT, &segP, &paused);
+    if (paused)
+        return segP;
+    return segP + (at - segT) * rate / 1000000;
+}
+
+/*
+ * endTime -- Cluster time the current song plays out after the events so far,
+ * 0 while it is paused.  The same on every speaker, so songs queued behind it
+ * stay in sync.  Called with the lock held.
+ */
+int64_t
+Player::endTime()
+{
+    int64_t rate = current->index.getRate();
+    int64_t segT, segP;
+    bool paused;
+
+    segment(&segT, &segP, &paused);
+    if (paused)
+        return 0;
+    return segT + (current->index.getSamples() - segP) * 1000000 / rate;
+}
+
+/*
+ * nextEvent -- Copy event idx of song s, optionally waiting for it.  Returns
+ * false if there is none, the decoder moved on to another song or the player
+ * is stopping.
+ */
+bool
+Player::nextEvent(uint64_t s, size_t idx, Event *ev, bool wait)
+{
+    unique_lock<mutex> lk(lock);
+
+    while (wait && !done && serial == s && idx >= events.size()) {
+        cv.wait(lk);
+    }
+    if (done || serial != s || idx >= events.size())
+        return false;
+
+    *ev = events[idx];
+    return true;
+}
+
+/*
+ * started -- An output reached the START of the current song, returns the
+ * song's serial.
+ */
+uint64_t
+Player::started()
+{
+    lock_guard<mutex> lk(lock);
+
+    pending--;
+    return serial;
+}
+
+/*
+ * finished -- An output is done with song s.  Once all of them are done with
+ * the current song the decoder can drop it.
+ */
+void
+Player::finished(uint64_t s)
+{
+    {
+        lock_guard<mutex> lk(lock);
+        if (s != serial)
+            return;
+        outputsDone++;
+        if (outputsDone >= outputs.size())
+            stopAt = -1;
+    }
+    cv.notify_all();
+}
+
+/*
+ * getLatency -- Largest output delay, the earliest an output starts ahead of
+ * a PLAY timestamp (us).
+ */
+int64_t
+Player::getLatency()
+{
+    return latency;
+}
+
+/*
+ * getLead -- How long before its start time a PLAY must arrive (us).  The
+ * largest output delay plus the time the last songs took from leaving the
+ * queue to every device being open and the first frame decoded.
+ */
+int64_t
+Player::getLead()
+{
+    return latency + max((int64_t)PLAYER_JOIN_LEAD, preroll.load());
+}
+
+/*
+ * run -- Decoder thread, turns queued songs into START, DATA... END chunks.
+ * After a SEEK it continues with DATA... END chunks of the next generation.
+ */
+void
+Player::run()
+{
+    if (config.rtPriority > 0) {
+        RTConfigureThread("decoder", config.rtPriority, config.outputCpu);
+    }
+
+    for (;;) {
+        Queued item;
+        Song *song;
+        PcmChunk *chunk;
+        size_t offset = 0;
+        uint32_t discard = 0;
+        int64_t position = 0;
+        uint32_t g = 0;
+        int64_t start;
+        int64_t now;
+
+        {
+            unique_lock<mutex> lk(lock);
+            while (!done && queue.empty()) {
+                cv.wait(lk);
+            }
+            if (done)
+                return;
+            item = queue.front();
+            queue.pop_front();
+        }
+
+        song = item.song;
+        start = item.start;
+        now = ts->getTime();
+        prepared = now;
+        if (item.late) {
+            uint32_t rate = song->index.getRate();
+            int64_t join = now + getLead();
+            int64_t target = (join - start) * rate / 1000000;
+
+            if (target >= song->index.getSamples() ||
+                !song->index.seek(song->buf, song->len, (uint32_t)target,
+                                  &offset, &discard)) {
+                printf("PLAY: song already over (started %lld us ago)\n",
+                       (long long)(now - start));
+                goto finish;
+            }
+            printf("PLAY: joining at sample %lld, byte %zu\n",
+                   (long long)target, offset);
+            start = join;
+            position = target;
+        } else if (start < lastEnd || start - latency < now) {
+            // Queued behind a song that ran long, play it once that one ends
+            int64_t pushed = max(max(start, lastEnd), now + getLead());
+
+            printf("PLAY: start pushed back %lld us\n",
+                   (long long)(pushed - start));
+            start = pushed;
+        }
+
+        if (!ts->isSynced())
+            printf("PLAY: time sync has not settled, may play out of sync\n");
+
+        {
+            lock_guard<mutex> lk(lock);
+            current = song;
+            serial++;
+            pending = outputs.size();
+            curStart = start;
+            curPosition = position;
+            gen = decGen = 0;
+            events.clear();
+            outputsDone = 0;
+            stopAt = INT64_MAX;
+        }
+        cv.notify_all();
+
+        chunk = fanout.reserve();
+        if (chunk == nullptr)
+            goto finish;
+        chunk->type = PCM_CHUNK_START;
+        chunk->start = start;
+        chunk->position = position;
+        chunk->gen = 0;
+        chunk->rate = song->index.getRate();
+        fanout.commit();
+
+        for (;;) {
+            bool complete = true;
+
+            if (offset < (size_t)song->len) {
+                printf("DecodeSong: len %d\n", song->len);
+                complete = DecodeSong(song->buf + offset, song->len - offset,
+                                      discard, position, g, &stopAt, &fanout);
+            }
+
+            if (complete) {
+                chunk = fanout.reserve();
+                if (chunk == nullptr)
+                    break;
+                chunk->type = PCM_CHUNK_END;
+                chunk->gen = g;
+                fanout.commit();
+            }
+
+            /*
+             * Until the outputs are done a SEEK may still come in.  Move on
+             * early if the next song has to be prepared, so that songs
+             * scheduled back to back play without a gap, but never while
+             * paused: the outputs are still waiting for the RESUME.
+             */
+            unique_lock<mutex> lk(lock);
+            while (complete && !done && outputsDone < outputs.size() &&
+                   gen == decGen) {
+                int64_t end = endTime();
+
+                if (queue.empty() || end == 0) {
+                    cv.wait(lk);
+                    continue;
+                }
+
+                int64_t due = max(queue.front().start, end) - getLead() -
+                              ts->getTime();
+                if (due <= 0)
+                    break;
+                cv.wait_for(lk, chrono::microseconds(due));
+            }
+            if (done || outputsDone >= outputs.size() || gen == decGen) {
+                // Let go before unlocking so no PAUSE lands after the end
+                lastEnd = endTime();
+                current = nullptr;
+                break;
+            }
+
+            Event next = {};
+            for (auto &&e : events) {
+                if (e.action != PLAYER_SEEK)
+                    continue;
+                if (e.gen == decGen + 1)
+                    position = e.position;
+                if (e.gen == decGen + 2)
+                    next = e;
+            }
+            g = ++decGen;
+            stopAt = next.gen != 0 ? next.cut : INT64_MAX;
+            lk.unlock();
+
+            offset = song->len;
+            discard = 0;
+            if (position < song->index.getSamples() &&
+                song->index.seek(song->buf, song->len, (uint32_t)position,
+                                 &offset, &discard)) {
+                printf("SEEK: to sample %lld, byte %zu\n",
+                       (long long)position, offset);
+            } else {
+                printf("SEEK: past the end of the song\n");
+            }
+        }
+
+finish:
+        {
+            lock_guard<mutex> lk(lock);
+            if (current == song) {
+                lastEnd = endTime();
+                current = nullptr;
+            }
+            song->refs--;
+        }
+        cv.notify_all();
+    }
+}
+
+/*
+ * writeFrames -- Process frames of chunk c from frame from on and write them.
+ */
+bool
+Player::writeFrames(Output *o, const DeviceFormat &dev, const PcmChunk *c,
+                    unsigned int from, unsigned int frames)
+{
+    const void *devbuf;
+    size_t devlen;
+
+    o->conv.configure(c->rate, dev);
+    o->proc.setInputLayout(c->channels, c->layout);
+    o->proc.process(c->pcm + from * c->channels, o->pcm.data(), frames);
+    devlen = o->conv.convert(o->pcm.data(), frames, &devbuf);
+
+    PERF_REGION(PERF_WRITE);
+    return o->dev->write(devbuf, devlen);
+}
+
+/*
+ * apply -- Act on ev once an output has written every sample before it.  A
+ * PAUSE waits for the RESUME or SEEK that ends it, or for the end of the song.
+ * Returns true when the output moved to a new generation or is over with the
+ * song and the rest of the chunk is stale.
+ */
+bool
+Player::apply(Output *o, Cursor *cur, const Event &ev)
+{
+    Event next = ev;
+
+    if (ev.action == PLAYER_PAUSE) {
+        int64_t paused = cur->segP +
+                         (ev.at - cur->segT) * cur->rate / 1000000;
+
+        do {
+            if (!nextEvent(cur->serial, cur->idx, &next, true)) {
+                cur->over = true;
+                return true;
+            }
+            cur->idx++;
+        } while (next.action == PLAYER_PAUSE);
+
+        // The device has run dry by now, restart it like at START
+        ts->sleepUntil(next.at - o->config.delay);
+        cur->segT = next.at;
+        cur->segP = paused;
+    }
+
+    if (next.action == PLAYER_SEEK) {
+        cur->segT = next.at;
+        cur->segP = next.position;
+        cur->gen = next.gen;
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * runOutput -- Output thread, plays every chunk of the fanout on one device.
+ * A device that fails to open still consumes its chunks so that it never
+ * holds up the other outputs.
+ */
+void
+Player::runOutput(Output *o)
+{
+    DeviceFormat dev;
+    bool active = false;    // Between START and END
+    bool playing = false;
+    int64_t ended = 0;      // Cluster time the last END was taken
+    Cursor cur = {};
+    Event ev;
+    const PcmChunk *c;
+    string name = "output " + o->config.device;
+
+    if (config.rtPriority > 0) {
+        RTConfigureThread(name.c_str(), config.rtPriority, config.outputCpu);
+    }
+
+    while ((c = fanout.next(o->id)) != nullptr) {
+        // The old generation ran out before a SEEK was due, catch up
+        while (playing && !cur.over && c->type != PCM_CHUNK_START &&
+               c->gen > cur.gen && nextEvent(cur.serial, cur.idx, &ev, true)) {
+            cur.idx++;
+            apply(o, &cur, ev);
+        }
+
+        switch (c->type) {
+            case PCM_CHUNK_START:
+                active = true;
+                cur.serial = started();
+                cur.segT = c->start;
+                cur.segP = c->position;
+                cur.gen = c->gen;
+                cur.rate = c->rate;
+                cur.idx = 0;
+                cur.over = false;
+
+                // Device setup takes milliseconds, get it out of the way first
+                dev.format = config.format;
+                dev.channels = 2;
+                dev.rate = config.rate;
+                playing = o->dev->open(&dev);
+                if (playing) {
+                    // Not counting the wait for the last song to play out
+                    int64_t setup = ts->getTime() - max(prepared.load(), ended);
+                    int64_t old = preroll;
+
+                    // Remember slow setups, forget them slowly
+                    while (!preroll.compare_exchange_weak(old,
+                               max(setup, old - old / 8))) {
+                    }
+                    o->proc.setOutputChannels(dev.channels);
+                    ts->sleepUntil(c->start - o->config.delay);
+                }
+                break;
+            case PCM_CHUNK_DATA: {
+                unsigned int from = 0;
+
+                if (!active || cur.over || c->gen != cur.gen)
+                    break;
+
+                while (playing && from < c->frames) {
+                    int64_t pos = c->position + from;
+                    unsigned int n = c->frames - from;
+                    bool due = nextEvent(cur.serial, cur.idx, &ev, false);
+
+                    // Only write up to the sample due at the next event
+                    if (due) {
+                        int64_t cut = cur.segP +
+                                      (ev.at - cur.segT) * cur.rate / 1000000;
+                        due = cut < pos + n;
+                        if (due)
+                            n = cut > pos ? cut - pos : 0;
+                    }
+
+                    if (n > 0 && !writeFrames(o, dev, c, from, n)) {
+                        o->dev->close();
+                        playing = false;
+                        break;
+                    }
+                    from += n;
+
+                    if (due) {
+                        cur.idx++;
+                        if (apply(o, &cur, ev))
+                            break;
+                    }
+                }
+                break;
+            }
+            case PCM_CHUNK_END:
+                if (!active || (playing && !cur.over && c->gen != cur.gen))
+                    break;
+                if (playing)
+                    o->dev->close();
+                playing = false;
+                active = false;
+                ended = ts->getTime();
+                finished(cur.serial);
+                break;
+        }
+        fanout.release(o->id);
+    }
+}
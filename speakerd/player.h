@@ -0,0 +1,162 @@
+
+#ifndef __PLAYER_H__
+#define __PLAYER_H__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "adts.h"
+#include "config.h"
+#include "fanout.h"
+#include "output.h"
+#include "pcm.h"
+#include "printer.h"
+#include "resample.h"
+#include "timesync.h"
+
+#define SONG_SLOTS  2
+#define SONG_LEN    MUSICPRINTER_MAXSONG
+
+// Least time allowed to seek, decode and open the devices before a start
+#define PLAYER_JOIN_LEAD    (50 * 1000)
+
+enum PlayerAction
+{
+    PLAYER_PAUSE,
+    PLAYER_RESUME,
+    PLAYER_SEEK,
+};
+
+struct Song
+{
+    char *buf;      // ADTS stream
+    int len;        // Bytes loaded
+    int refs;       // Queued or playing
+    ADTSIndex index;    // Frame offsets for seeking
+};
+
+/*
+ * Player -- Plays loaded songs at their scheduled time on dedicated threads.
+ *
+ * The command connection stays responsive while a song plays so that GETTIME
+ * keeps working and the next song can be loaded and scheduled right behind
+ * the current one.  Songs live in SONG_SLOTS preallocated buffers.
+ *
+ * A PLAY whose start time had already passed when it arrived joins the song
+ * in progress: the frame index locates the current position and playback
+ * picks up from there.  A song that was on time but queued behind one that
+ * ran long plays in full as soon as that one ends.
+ *
+ * One decoder thread feeds every output through a PcmFanout, each output has
+ * its own thread, device, channel map, gain and latency compensation.  An
+ * output starts its configured delay ahead of the PLAY timestamp so that the
+ * first sample is heard, not just written, at the timestamp.  Every LOAD is
+ * acknowledged with getLead(), so the sender can schedule the song as early
+ * as the slowest speaker allows.
+ *
+ * PAUSE, RESUME and SEEK apply to the song being played at a future cluster
+ * time.  Every output cuts its stream at the sample due at that time, so all
+ * of them stop, continue or jump on the same sample.
+ */
+class Player
+{
+public:
+    Player(TimeSync *ts, const std::vector<OutputConfig> &outputs);
+    ~Player();
+    Player(const Player &) = delete;
+    Player &operator=(const Player &) = delete;
+    void start();
+    void stop();
+    void prefault();
+    Song *acquire();
+    void loaded(Song *s, bool ok);
+    bool play(int64_t timestamp);
+    bool pause(int64_t at);
+    bool resume(int64_t at);
+    bool seek(int64_t at, int64_t position);
+    int64_t getLatency();
+    int64_t getLead();
+private:
+    struct Event
+    {
+        PlayerAction action;
+        int64_t at;         // Cluster time
+        int64_t position;   // SEEK: song sample played at at
+        int64_t cut;        // SEEK: last sample + 1 of the previous gen
+        uint32_t gen;       // SEEK: generation of the new chunks
+    };
+    // Where an output is in the song, sample segP plays at segT
+    struct Cursor
+    {
+        int64_t segT;
+        int64_t segP;
+        uint32_t gen;
+        uint32_t rate;
+        size_t idx;         // Next event
+        uint64_t serial;    // Song
+        bool over;          // Song replaced or player stopping
+    };
+    struct Queued
+    {
+        Song *song;
+        int64_t start;      // Cluster time
+        bool late;          // Start had passed when the PLAY came in
+    };
+    struct Output
+    {
+        int id;                     // Fanout consumer
+        OutputConfig config;
+        AudioOutput *dev;
+        std::thread *thr;
+        PcmProcessor proc;
+        FormatConverter conv;
+        std::vector<int16_t> pcm;   // Processed frame
+    };
+    void run();
+    void runOutput(Output *o);
+    bool writeFrames(Output *o, const DeviceFormat &dev, const PcmChunk *c,
+                     unsigned int from, unsigned int frames);
+    bool apply(Output *o, Cursor *cur, const Event &ev);
+    bool control(Event ev);
+    void segment(int64_t *segT, int64_t *segP, bool *paused);
+    int64_t positionAt(int64_t at);
+    int64_t endTime();
+    bool nextEvent(uint64_t s, size_t idx, Event *ev, bool wait);
+    uint64_t started();
+    void finished(uint64_t s);
+    TimeSync *ts;
+    PcmFanout fanout;
+    std::vector<Output *> outputs;
+    int64_t latency;    // Largest output delay
+    std::atomic<int64_t> prepared;  // Cluster time the decoder took a song
+    std::atomic<int64_t> preroll;   // Slowest recent song setup (us)
+    bool done;
+    std::thread *thr;
+    std::mutex lock;
+    std::condition_variable cv;
+    Song slots[SONG_SLOTS];
+    Song *last;
+    std::deque<Queued> queue;
+    int64_t lastEnd;        // Cluster time the last song played ends
+    // The song being decoded, from its START until every output is done
+    Song *current;
+    uint64_t serial;
+    size_t pending;         // Outputs still on the song before
+    int64_t curStart;       // Cluster time of curPosition
+    int64_t curPosition;    // Song sample the outputs started with
+    uint32_t gen;           // Of the latest SEEK
+    uint32_t decGen;        // Being decoded
+    std::vector<Event> events;  // In time order
+    size_t outputsDone;
+    std::atomic<int64_t> stopAt;    // Decoder cut for the next SEEK
+};
+
+#endif /* __PLAYER_H__ */
+
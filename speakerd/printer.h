@@ -1,9 +1,69 @@
 
+#ifndef __PRINTER_H__
+#define __PRINTER_H__
 #define MUSICPRINTER_PORT 8085
 #define TIMESYNC_PORT 8086
 
-// Commands
+/*
+ * XXX: Set to the local broadcast address of the network.  Run ifconfig to see 
+ * the broadcast address for the local area network where all the machines run 
+ * on.  You can also broadcast to 255.255.255.255 but machines with multiple 
+ * NICs may not route the packet to the correct network.  speakerd -p overrides
+ * it at runtime.
+ */
+#define TIMESYNC_BROADCAST "129.97.75.255"
+
+// Live speakers as seen by the local speakerd, read by lpr-music
+#define MUSICPRINTER_REGISTRY "/var/run/speakerd.registry"
+
+// Local socket of the lpr-music conductor
+#define MUSICPRINTER_CONDUCTOR "/var/run/lpr-music.sock"
+
+// Group allowed to submit jobs to the conductor, lpd runs filters as daemon
+#define MUSICPRINTER_CONDUCTOR_GROUP "daemon"
+
+// Largest song a speaker can hold
+#define MUSICPRINTER_MAXSONG (10 * 1024 * 1024)
+
+/*
+ * IP TOS bytes (DSCP << 2).  Time sync announcements are marked EF and song
+ * transfers CS1 so switches and hosts that honour DSCP queue bulk data behind
+ * sync packets instead of in front of them.
+ */
+#define MUSICPRINTER_TOS_SYNC 0xb8  // DSCP EF
+#define MUSICPRINTER_TOS_BULK 0x20  // DSCP CS1
+
+// Every command starts with this magic, the command and one argument
+#define MUSICPRINTER_MAGIC 0xAA55AA55
+
+/*
+ * Commands.  LOAD is answered with an int32_t, -1 if the song was not stored,
+ * else the lead (us) the speaker needs between receiving PLAY and the start.
+ */
 #define MUSICPRINTER_LOAD 1
 #define MUSICPRINTER_GETTIME 2
 #define MUSICPRINTER_PLAY 3
 
+/*
+ * RELAY is a LOAD passed down a chain of speakers, arg is the song length.
+ * It is followed by a uint32_t hop count, that many IPv4 addresses (network
+ * order) and the song.  The speaker stores the song and forwards it as it
+ * arrives to the first hop it can reach, along with the hops behind that one.
+ * It then replies with a uint32_t count, the addresses of the speakers down
+ * the chain that stored the song, itself first, and the largest of their
+ * leads as an int32_t.
+ */
+#define MUSICPRINTER_RELAY 4
+#define MUSICPRINTER_RELAY_MAXHOPS 32
+
+/*
+ * Control the song being played.  Each is followed by the int64_t cluster
+ * time to act at, like PLAY.  SEEK jumps to arg ms into the song and resumes
+ * a paused song.
+ */
+#define MUSICPRINTER_PAUSE 5
+#define MUSICPRINTER_RESUME 6
+#define MUSICPRINTER_SEEK 7
+
+#endif /* __PRINTER_H__ */
+
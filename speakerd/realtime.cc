@@ -0,0 +1,124 @@
+/*
+ * Realtime Playback Support
+ *
+ * On a shared host the output loop and the time sync threads compete with
+ * everything else on the machine.  A late write underruns the sound device and
+ * a late recvfrom inflates the time delta samples.  When enabled the threads
+ * run under SCHED_FIFO, optionally pinned to a core, and all memory is locked
+ * so that page faults never land in the middle of playback.
+ *
+ * Each of these needs privileges (root, or RLIMIT_RTPRIO/RLIMIT_MEMLOCK on
+ * Linux) so failures are reported and playback continues without them.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#if defined(__FreeBSD__)
+#include <pthread_np.h>
+#include <sys/cpuset.h>
+typedef cpuset_t CpuSet;
+#else
+typedef cpu_set_t CpuSet;
+#endif
+
+#include "realtime.h"
+
+/*
+ * RTConfigureThread -- Move the calling thread into SCHED_FIFO at the given
+ * priority and pin it to cpu (when cpu >= 0).
+ */
+bool
+RTConfigureThread(const char *name, int priority, int cpu)
+{
+    bool ok = true;
+    int status;
+    struct sched_param sp;
+    int pmin = sched_get_priority_min(SCHED_FIFO);
+    int pmax = sched_get_priority_max(SCHED_FIFO);
+
+    if (priority < pmin || priority > pmax) {
+        printf("%s: realtime priority %d out of range [%d, %d]\n",
+               name, priority, pmin, pmax);
+        priority = (priority < pmin) ? pmin : pmax;
+    }
+
+    memset(&sp, 0, sizeof(sp));
+    sp.sched_priority = priority;
+    status = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+    if (status == EPERM) {
+        printf("%s: not permitted to use SCHED_FIFO, run as root or raise "
+               "RLIMIT_RTPRIO\n", name);
+        ok = false;
+    } else if (status != 0) {
+        printf("%s: pthread_setschedparam: %s\n", name, strerror(status));
+        ok = false;
+    }
+
+    if (cpu >= 0) {
+        CpuSet set;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        status = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (status != 0) {
+            printf("%s: cannot pin to cpu %d: %s\n",
+                   name, cpu, strerror(status));
+            ok = false;
+        }
+    }
+
+    if (ok) {
+        printf("%s: SCHED_FIFO priority %d", name, priority);
+        if (cpu >= 0)
+            printf(" on cpu %d", cpu);
+        printf("\n");
+    }
+
+    return ok;
+}
+
+/*
+ * RTLockMemory -- Lock all current and future mappings into memory.
+ */
+bool
+RTLockMemory()
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        if (errno == EPERM || errno == ENOMEM || errno == EAGAIN) {
+            printf("mlockall: %s, run as root or raise RLIMIT_MEMLOCK\n",
+                   strerror(errno));
+        } else {
+            perror("mlockall");
+        }
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * RTPrefault -- Touch every page of buf so that it is backed by real memory
+ * before playback starts.  Zero fill pages must be written, a read would only
+ * map the shared zero page.
+ */
+void
+RTPrefault(void *buf, size_t len)
+{
+    volatile char *p = (volatile char *)buf;
+    long pagesz = sysconf(_SC_PAGESIZE);
+
+    for (size_t off = 0; off < len; off += pagesz) {
+        p[off] = p[off];
+    }
+    if (len > 0) {
+        p[len - 1] = p[len - 1];
+    }
+}
+
@@ -0,0 +1,12 @@
+
+#ifndef __REALTIME_H__
+#define __REALTIME_H__
+
+#include <stddef.h>
+
+bool RTConfigureThread(const char *name, int priority, int cpu);
+bool RTLockMemory();
+void RTPrefault(void *buf, size_t len);
+
+#endif /* __REALTIME_H__ */
+
@@ -0,0 +1,446 @@
+/*
+ * Sample Rate and Format Conversion
+ *
+ * The decoder hands us whatever rate the song was encoded at while the sound
+ * device runs at a single configured rate.  A rate change by L/M is done with
+ * a polyphase FIR: conceptually upsample by L, low pass, then keep every M-th
+ * sample.  Only the L phases of the prototype filter that are actually needed
+ * are evaluated, each one RESAMPLE_TAPS long.
+ *
+ * Common conversions (48k, 32k, 22.05k, 16k, 8k to 44.1k and back) all reduce
+ * to L <= 441 so the filter bank is exact and stays below 64KB.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <iostream>
+#include <numeric>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+ * XXX: ChangeMe when recompiling on other platforms
+ * BSD OSS is in sys/soundcard.h
+ * Linux uses linux/soundcard.h
+ */
+#include <sys/soundcard.h>
+
+#include "resample.h"
+
+using namespace std;
+
+#define RESAMPLE_TAPS       32
+#define RESAMPLE_MAX_PHASES 1024
+#define RESAMPLE_ROLLOFF    0.92
+#define RESAMPLE_BETA       8.0
+
+#define RESAMPLE_Q          14
+
+typedef int16_t (*DotS16Fn)(const int16_t *x, const int16_t *h, int taps);
+typedef float (*DotF32Fn)(const float *x, const float *h, int taps);
+
+/*
+ * Bessel function of the first kind, order zero.  Only used for the Kaiser
+ * window so the series converges quickly.
+ */
+static double
+BesselI0(double x)
+{
+    double sum = 1.0;
+    double term = 1.0;
+
+    for (int k = 1; k < 50; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < sum * 1e-12)
+            break;
+    }
+
+    return sum;
+}
+
+PolyphaseFilter::PolyphaseFilter()
+    : taps(RESAMPLE_TAPS), up(1), down(1), q14(), f32()
+{
+}
+
+PolyphaseFilter::~PolyphaseFilter()
+{
+}
+
+bool
+PolyphaseFilter::build(int inRate, int outRate)
+{
+    if (inRate <= 0 || outRate <= 0) {
+        return false;
+    }
+
+    int g = gcd(inRate, outRate);
+    up = outRate / g;
+    down = inRate / g;
+
+    if (up > RESAMPLE_MAX_PHASES) {
+        cout << "Unsupported rate conversion " << inRate << " -> "
+             << outRate << endl;
+        return false;
+    }
+
+    // Prototype runs at up * inRate, cut off below the lower Nyquist rate
+    int len = taps * up;
+    double fc = 0.5 * RESAMPLE_ROLLOFF * min(1.0, (double)up / down) / up;
+    double i0beta = BesselI0(RESAMPLE_BETA);
+    vector<double> proto(len);
+
+    /*
+     * Centered on taps/2 input samples so that together with the silence the
+     * Resampler primes its history with the output has no group delay.
+     */
+    for (int n = 0; n < len; n++) {
+        double t = n - len / 2.0;
+        double x = 2.0 * fc * t;
+        double sinc = (x == 0.0) ? 1.0 : sin(M_PI * x) / (M_PI * x);
+        double r = t / (len / 2.0);
+        double w = BesselI0(RESAMPLE_BETA * sqrt(max(0.0, 1.0 - r * r))) /
+                   i0beta;
+
+        proto[n] = 2.0 * fc * sinc * w;
+    }
+
+    q14.assign(len, 0);
+    f32.assign(len, 0.0f);
+
+    for (int p = 0; p < up; p++) {
+        double sum = 0.0;
+
+        for (int k = 0; k < taps; k++) {
+            sum += proto[p + k * up];
+        }
+
+        // Unity DC gain in every phase, reversed for the dot product
+        for (int k = 0; k < taps; k++) {
+            double h = proto[p + k * up] / sum;
+
+            f32[p * taps + (taps - 1 - k)] = (float)h;
+            q14[p * taps + (taps - 1 - k)] =
+                (int16_t)lround(h * (1 << RESAMPLE_Q));
+        }
+    }
+
+    return true;
+}
+
+static int16_t
+Saturate(int32_t v)
+{
+    if (v > INT16_MAX)
+        return INT16_MAX;
+    if (v < INT16_MIN)
+        return INT16_MIN;
+    return (int16_t)v;
+}
+
+#if !defined(__SSE2__) && !defined(__ARM_NEON)
+static int16_t
+DotS16Scalar(const int16_t *x, const int16_t *h, int taps)
+{
+    int32_t acc = 1 << (RESAMPLE_Q - 1);
+
+    for (int k = 0; k < taps; k++) {
+        acc += (int32_t)x[k] * h[k];
+    }
+
+    return Saturate(acc >> RESAMPLE_Q);
+}
+
+static float
+DotF32Scalar(const float *x, const float *h, int taps)
+{
+    float acc = 0.0f;
+
+    for (int k = 0; k < taps; k++) {
+        acc += x[k] * h[k];
+    }
+
+    return acc;
+}
+#endif
+
+#if defined(__SSE2__)
+static int16_t
+DotS16SSE2(const int16_t *x, const int16_t *h, int taps)
+{
+    __m128i acc = _mm_setzero_si128();
+
+    for (int k = 0; k < taps; k += 8) {
+        __m128i vx = _mm_loadu_si128((const __m128i *)(x + k));
+        __m128i vh = _mm_loadu_si128((const __m128i *)(h + k));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(vx, vh));
+    }
+
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    return Saturate((_mm_cvtsi128_si32(acc) + (1 << (RESAMPLE_Q - 1))) >>
+                    RESAMPLE_Q);
+}
+
+static float
+DotF32SSE2(const float *x, const float *h, int taps)
+{
+    __m128 acc = _mm_setzero_ps();
+    float out[4];
+
+    for (int k = 0; k < taps; k += 4) {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x + k),
+                                         _mm_loadu_ps(h + k)));
+    }
+
+    _mm_storeu_ps(out, acc);
+    return (out[0] + out[1]) + (out[2] + out[3]);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static int16_t
+DotS16AVX2(const int16_t *x, const int16_t *h, int taps)
+{
+    __m256i acc = _mm256_setzero_si256();
+
+    for (int k = 0; k < taps; k += 16) {
+        __m256i vx = _mm256_loadu_si256((const __m256i *)(x + k));
+        __m256i vh = _mm256_loadu_si256((const __m256i *)(h + k));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(vx, vh));
+    }
+
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc),
+                                _mm256_extracti128_si256(acc, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    return Saturate((_mm_cvtsi128_si32(sum) + (1 << (RESAMPLE_Q - 1))) >>
+                    RESAMPLE_Q);
+}
+
+__attribute__((target("avx2")))
+static float
+DotF32AVX2(const float *x, const float *h, int taps)
+{
+    __m256 acc = _mm256_setzero_ps();
+    float out[8];
+
+    for (int k = 0; k < taps; k += 8) {
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(x + k),
+                                               _mm256_loadu_ps(h + k)));
+    }
+
+    _mm256_storeu_ps(out, acc);
+    return ((out[0] + out[1]) + (out[2] + out[3])) +
+           ((out[4] + out[5]) + (out[6] + out[7]));
+}
+#endif
+
+#if defined(__ARM_NEON)
+static int16_t
+DotS16NEON(const int16_t *x, const int16_t *h, int taps)
+{
+    int32x4_t acc = vdupq_n_s32(0);
+
+    for (int k = 0; k < taps; k += 8) {
+        int16x8_t vx = vld1q_s16(x + k);
+        int16x8_t vh = vld1q_s16(h + k);
+        acc = vmlal_s16(acc, vget_low_s16(vx), vget_low_s16(vh));
+        acc = vmlal_s16(acc, vget_high_s16(vx), vget_high_s16(vh));
+    }
+
+    int32x2_t sum = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+    sum = vpadd_s32(sum, sum);
+
+    return Saturate((vget_lane_s32(sum, 0) + (1 << (RESAMPLE_Q - 1))) >>
+                    RESAMPLE_Q);
+}
+
+static float
+DotF32NEON(const float *x, const float *h, int taps)
+{
+    float32x4_t acc = vdupq_n_f32(0.0f);
+
+    for (int k = 0; k < taps; k += 4) {
+        acc = vmlaq_f32(acc, vld1q_f32(x + k), vld1q_f32(h + k));
+    }
+
+    float32x2_t sum = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    return vget_lane_f32(vpadd_f32(sum, sum), 0);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+static bool
+HaveAVX2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+static DotS16Fn
+SelectDotS16()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (HaveAVX2())
+        return DotS16AVX2;
+#endif
+#if defined(__SSE2__)
+    return DotS16SSE2;
+#elif defined(__ARM_NEON)
+    return DotS16NEON;
+#else
+    return DotS16Scalar;
+#endif
+}
+
+static DotF32Fn
+SelectDotF32()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (HaveAVX2())
+        return DotF32AVX2;
+#endif
+#if defined(__SSE2__)
+    return DotF32SSE2;
+#elif defined(__ARM_NEON)
+    return DotF32NEON;
+#else
+    return DotF32Scalar;
+#endif
+}
+
+static DotS16Fn DotS16Impl = SelectDotS16();
+static DotF32Fn DotF32Impl = SelectDotF32();
+
+/*
+ * DotS16 -- Q14 dot product of taps samples, taps must be a multiple of 16.
+ */
+int16_t
+DotS16(const int16_t *x, const int16_t *h, int taps)
+{
+    return DotS16Impl(x, h, taps);
+}
+
+/*
+ * DotF32 -- Float dot product of taps samples, taps must be a multiple of 8.
+ */
+float
+DotF32(const float *x, const float *h, int taps)
+{
+    return DotF32Impl(x, h, taps);
+}
+
+FormatConverter::FormatConverter()
+    : inRate(0), dev(), s16Mono(), s16Stereo(), f32Mono(), f32Stereo(),
+      out16(), in32f(), out32f(), out32()
+{
+}
+
+FormatConverter::~FormatConverter()
+{
+}
+
+/*
+ * configure -- Set up conversion from 16-bit PCM at inRate with dev.channels
+ * channels to the device format.  Called again whenever the stream changes.
+ */
+bool
+FormatConverter::configure(int rate, const DeviceFormat &d)
+{
+    bool status = true;
+
+    if (rate == inRate && memcmp(&d, &dev, sizeof(d)) == 0) {
+        return true;
+    }
+
+    inRate = rate;
+    dev = d;
+
+    if (dev.rate != inRate) {
+        cout << "Resampling " << inRate << " Hz -> " << dev.rate << " Hz"
+             << endl;
+    }
+
+    if (dev.format == AFMT_S16_NE) {
+        if (dev.channels == 1)
+            status = s16Mono.configure(inRate, dev.rate);
+        else
+            status = s16Stereo.configure(inRate, dev.rate);
+    } else {
+        if (dev.channels == 1)
+            status = f32Mono.configure(inRate, dev.rate);
+        else
+            status = f32Stereo.configure(inRate, dev.rate);
+    }
+
+    return status;
+}
+
+/*
+ * convert -- Convert frames of interleaved 16-bit PCM.  On return *out points
+ * to device format samples owned by the converter (or in itself when nothing
+ * needs to change).  Returns the length of *out in bytes.
+ */
+size_t
+FormatConverter::convert(const int16_t *in, size_t frames, const void **out)
+{
+    size_t samples = frames * dev.channels;
+
+    if (dev.format == AFMT_S16_NE) {
+        if (dev.rate == inRate) {
+            *out = in;
+            return samples * sizeof(int16_t);
+        }
+
+        out16.clear();
+        if (dev.channels == 1)
+            s16Mono.process(in, frames, out16);
+        else
+            s16Stereo.process(in, frames, out16);
+
+        *out = out16.data();
+        return out16.size() * sizeof(int16_t);
+    }
+
+    in32f.resize(samples);
+    for (size_t i = 0; i < samples; i++) {
+        in32f[i] = in[i] * (1.0f / 32768.0f);
+    }
+
+    out32f.clear();
+    if (dev.channels == 1)
+        f32Mono.process(in32f.data(), frames, out32f);
+    else
+        f32Stereo.process(in32f.data(), frames, out32f);
+
+    out32.resize(out32f.size());
+    for (size_t i = 0; i < out32f.size(); i++) {
+        float v = out32f[i] * 2147483648.0f;
+
+        if (v >= 2147483647.0f)
+            out32[i] = INT32_MAX;
+        else if (v <= -2147483648.0f)
+            out32[i] = INT32_MIN;
+        else
+            out32[i] = (int32_t)lrintf(v);
+    }
+
+    *out = out32.data();
+    return out32.size() * sizeof(int32_t);
+}
+
@@ -0,0 +1,181 @@
+
+#ifndef __RESAMPLE_H__
+#define __RESAMPLE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+/*
+ * Sample format, rate and channel count accepted by the sound device.
+ */
+struct DeviceFormat
+{
+    int format;     // AFMT_S16_NE or AFMT_S32_NE
+    int channels;   // 1 or 2
+    int rate;       // Hz
+};
+
+/*
+ * PolyphaseFilter -- Windowed sinc filter bank for a rational L/M rate change.
+ *
+ * Each of the L phases holds RESAMPLE_TAPS coefficients stored in reverse so
+ * an output sample is a plain dot product with the input history.
+ */
+class PolyphaseFilter
+{
+public:
+    PolyphaseFilter();
+    ~PolyphaseFilter();
+    bool build(int inRate, int outRate);
+    int getTaps() const { return taps; }
+    int getUp() const { return up; }
+    int getDown() const { return down; }
+    const int16_t *phaseS16(int p) const { return &q14[p * taps]; }
+    const float *phaseF32(int p) const { return &f32[p * taps]; }
+private:
+    int taps;
+    int up;
+    int down;
+    std::vector<int16_t> q14;
+    std::vector<float> f32;
+};
+
+int16_t DotS16(const int16_t *x, const int16_t *h, int taps);
+float DotF32(const float *x, const float *h, int taps);
+
+template <typename Sample>
+struct ResampleKernel;
+
+template <>
+struct ResampleKernel<int16_t>
+{
+    static int16_t dot(const int16_t *x, const PolyphaseFilter &f, int p)
+    {
+        return DotS16(x, f.phaseS16(p), f.getTaps());
+    }
+};
+
+template <>
+struct ResampleKernel<float>
+{
+    static float dot(const float *x, const PolyphaseFilter &f, int p)
+    {
+        return DotF32(x, f.phaseF32(p), f.getTaps());
+    }
+};
+
+/*
+ * Resampler -- Streaming polyphase sample rate converter.
+ *
+ * Specialized at compile time on the sample type and channel count.  Input is
+ * interleaved, the history is kept planar so every channel runs the same
+ * contiguous SIMD dot product.  The history starts with half a filter of
+ * silence which cancels the filter's group delay and keeps the output aligned
+ * with the input timeline.
+ */
+template <typename Sample, int Channels>
+class Resampler
+{
+public:
+    Resampler() : filter(), passthrough(true), pos(0), phase(0), hist() {}
+    ~Resampler() {}
+
+    bool configure(int inRate, int outRate)
+    {
+        bool ok = true;
+
+        passthrough = (inRate == outRate);
+        if (!passthrough && !filter.build(inRate, outRate)) {
+            passthrough = true;
+            ok = false;
+        }
+        reset();
+
+        return ok;
+    }
+
+    void reset()
+    {
+        pos = 0;
+        phase = 0;
+        for (int c = 0; c < Channels; c++) {
+            hist[c].assign(passthrough ? 0 : filter.getTaps() / 2 - 1, Sample());
+        }
+    }
+
+    /*
+     * process -- Consume frames of interleaved input and append the resulting
+     * interleaved output frames to out.
+     */
+    void process(const Sample *in, size_t frames, std::vector<Sample> &out)
+    {
+        if (passthrough) {
+            out.insert(out.end(), in, in + frames * Channels);
+            return;
+        }
+
+        for (size_t f = 0; f < frames; f++) {
+            for (int c = 0; c < Channels; c++) {
+                hist[c].push_back(in[f * Channels + c]);
+            }
+        }
+
+        const size_t taps = filter.getTaps();
+        const int up = filter.getUp();
+        const int down = filter.getDown();
+        const size_t avail = hist[0].size();
+
+        while (pos + taps <= avail) {
+            for (int c = 0; c < Channels; c++) {
+                out.push_back(ResampleKernel<Sample>::dot(&hist[c][pos],
+                                                          filter, phase));
+            }
+            phase += down;
+            pos += phase / up;
+            phase %= up;
+        }
+
+        for (int c = 0; c < Channels; c++) {
+            hist[c].erase(hist[c].begin(), hist[c].begin() + pos);
+        }
+        pos = 0;
+    }
+
+private:
+    PolyphaseFilter filter;
+    bool passthrough;
+    size_t pos;
+    int phase;
+    std::vector<Sample> hist[Channels];
+};
+
+/*
+ * FormatConverter -- Adapt processed 16-bit PCM to the device format.
+ *
+ * 16-bit devices resample in Q14 fixed point.  32-bit devices resample in
+ * float so the extra precision of the filter reaches the DAC.
+ */
+class FormatConverter
+{
+public:
+    FormatConverter();
+    ~FormatConverter();
+    bool configure(int inRate, const DeviceFormat &dev);
+    size_t convert(const int16_t *in, size_t frames, const void **out);
+private:
+    int inRate;
+    DeviceFormat dev;
+    Resampler<int16_t, 1> s16Mono;
+    Resampler<int16_t, 2> s16Stereo;
+    Resampler<float, 1> f32Mono;
+    Resampler<float, 2> f32Stereo;
+    std::vector<int16_t> out16;
+    std::vector<float> in32f;
+    std::vector<float> out32f;
+    std::vector<int32_t> out32;
+};
+
+#endif /* __RESAMPLE_H__ */
+
@@ -1,9 +1,18 @@
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
 #include <netinet/in.h>
 
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -16,7 +25,15 @@
 
 #include <fdk-aac/aacdecoder_lib.h>
 
+#include "config.h"
+#include "output.h"
+#include "perf.h"
+#include "pcm.h"
 #include "printer.h"
+#include "player.h"
+#include "realtime.h"
+#include "resample.h"
+#include "speaker.h"
 #include "timesync.h"
 /*
  * Simple music player that decodes AAC files and plays them through Open Sound 
@@ -26,85 +43,102 @@
  *   Using ADTS transport type (TT_MP4_ADTS) typically this corresponds to .aac 
  *   extentions that I found.
  *
- * Output is set to stereo S16
+ * The decoder keeps the native channel layout and hands frames to the
+ * Player's outputs through a PcmFanout.  Each output applies its own gain,
+ * channel map and downmix and converts to the format its device accepted.
+ *
+ * Every command connection is served by its own thread.  A RELAY is a LOAD
+ * that is also forwarded chunk by chunk to the next speaker in a chain, so
+ * the sender uploads a song once and distribution takes about one transfer
+ * plus a chunk of delay per hop.
  */
 
 using namespace std;
 
-#define MAX_OUTPUT  (8 * 1024 * 1024)
-
-#define DEFAULT_DSP "/dev/dsp0.0"
-
-int
-OpenAndConfigureOSS()
+/*
+ * StreamLayout -- Translate the decoder channel description into speaker
+ * positions.  Within each channel type FDK numbers a lone center channel first
+ * followed by left/right pairs.
+ */
+static bool
+StreamLayout(CStreamInfo *info, PcmPosition *layout)
 {
-    int fd;
-    int status;
+    int n = info->numChannels;
 
-    fd = open(DEFAULT_DSP, O_WRONLY);
-    if (fd < 0) {
-        perror("open dsp");
-        return -1;
+    if (n < 1 || n > PCM_MAX_CHANNELS) {
+        return false;
     }
 
-    int fmt = AFMT_S16_NE;
-    status = ioctl(fd, SNDCTL_DSP_SETFMT, &fmt);
-    if (status < 0) {
-        perror("ioctl SETFMT");
-        close(fd);
-        return -1;
+    if (info->pChannelType == nullptr || info->pChannelIndices == nullptr) {
+        for (int c = 0; c < n; c++) {
+            layout[c] = PCM_POS_OTHER;
+        }
+        if (n == 1) {
+            layout[0] = PCM_POS_CENTER;
+        } else if (n == 2) {
+            layout[0] = PCM_POS_LEFT;
+            layout[1] = PCM_POS_RIGHT;
+        }
+        return true;
     }
 
-    int chans = 2;
-    status = ioctl(fd, SNDCTL_DSP_CHANNELS, &chans);
-    if (status < 0) {
-        perror("ioctl CHANNELS");
-        close(fd);
-        return -1;
-    }
+    for (int c = 0; c < n; c++) {
+        AUDIO_CHANNEL_TYPE type = info->pChannelType[c];
+        int idx = info->pChannelIndices[c];
+        int count = 0;
 
-    int speed = 44100;
-    status = ioctl(fd, SNDCTL_DSP_SPEED, &speed);
-    if (status < 0) {
-        perror("ioctl SPEED");
-        close(fd);
-        return -1;
-    }
+        for (int k = 0; k < n; k++) {
+            if (info->pChannelType[k] == type)
+                count++;
+        }
 
-    int stereo = 1;
-    status = ioctl(fd, SNDCTL_DSP_STEREO, &stereo);
-    if (status < 0) {
-        perror("ioctl SPEED");
-        close(fd);
-        return -1;
+        bool center = (count % 2 == 1) && (idx == 0);
+        bool left = ((idx - (count % 2)) % 2) == 0;
+
+        switch (type) {
+            case ACT_FRONT:
+                layout[c] = center ? PCM_POS_CENTER :
+                            (left ? PCM_POS_LEFT : PCM_POS_RIGHT);
+                break;
+            case ACT_SIDE:
+            case ACT_BACK:
+                layout[c] = center ? PCM_POS_OTHER :
+                            (left ? PCM_POS_SURROUND_LEFT :
+                                    PCM_POS_SURROUND_RIGHT);
+                break;
+            case ACT_LFE:
+                layout[c] = PCM_POS_LFE;
+                break;
+            default:
+                layout[c] = PCM_POS_OTHER;
+                break;
+        }
     }
 
-    return fd;
+    return true;
 }
 
-void
-DecodeAndPlay(char *buf, unsigned int len, int ossfd)
+/*
+ * DecodeSong -- Decode the ADTS stream in buf into the fanout, dropping the
+ * first discard samples (per channel) of decoder output.  Chunks are tagged
+ * with gen and their position in the song, counting from position.  Decoding
+ * ends early, on the exact sample, once the position reaches *stopAt.
+ * Returns false if the fanout shut down or decoding was stopped.
+ */
+bool
+DecodeSong(char *buf, unsigned int len, unsigned int discard,
+           int64_t position, uint32_t gen, const atomic<int64_t> *stopAt,
+           PcmFanout *fan)
 {
     HANDLE_AACDECODER decoder;
     AAC_DECODER_ERROR status;
     CStreamInfo *info;
-
-    char *outbuf = new char[MAX_OUTPUT];
+    PcmChunk *chunk = nullptr;
+    int rate = 0;
+    bool ok = true;
 
     decoder = aacDecoder_Open(TT_MP4_ADTS, 1);
 
-    status = aacDecoder_SetParam(decoder, AAC_PCM_MIN_OUTPUT_CHANNELS, 2);
-    if (status != AAC_DEC_OK) {
-        printf("aacDecoder_SetParam1 Error %x\n", status);
-        return;
-    }
-
-    status = aacDecoder_SetParam(decoder, AAC_PCM_MAX_OUTPUT_CHANNELS, 2);
-    if (status != AAC_DEC_OK) {
-        printf("aacDecoder_SetParam2 Error %x\n", status);
-        return;
-    }
-
     do {
         unsigned int bytesValid = len;
 
@@ -113,36 +147,85 @@ DecodeAndPlay(char *buf, unsigned int len, int ossfd)
         status = aacDecoder_Fill(decoder, bufs, lens, &bytesValid);
         if (status != AAC_DEC_OK) {
             printf("aacDecoder_Fill Error %x\n", status);
-            return;
+            break;
         }
 
-        printf("len: %u, bytesValid: %u\n", len, bytesValid);
         unsigned int usedUp = len - bytesValid;
         buf += usedUp;
         len -= usedUp;
 
-        status = aacDecoder_DecodeFrame(decoder, (INT_PCM *)outbuf, MAX_OUTPUT, 0);
+        if (chunk == nullptr) {
+            chunk = fan->reserve();
+            if (chunk == nullptr) {
+                ok = false;
+                break;
+            }
+        }
+
+        {
+            PERF_REGION(PERF_DECODE);
+            status = aacDecoder_DecodeFrame(decoder, (INT_PCM *)chunk->pcm,
+                                            sizeof(chunk->pcm) /
+                                            sizeof(INT_PCM), 0);
+        }
         if (status == AAC_DEC_NOT_ENOUGH_BITS) {
             continue;
         }
         if (status != AAC_DEC_OK) {
             printf("aacDecoder_DecodeFrame Error %x\n", status);
-            return;
+            break;
         }
 
         info = aacDecoder_GetStreamInfo(decoder);
-        if (info->sampleRate != 44100 || info->numChannels != 2) {
+        if (info->sampleRate != rate) {
+            rate = info->sampleRate;
             cout << "Music Statistics" << endl;
             cout << "    Sample Rate: " << info->sampleRate << endl;
             cout << "    Channels: " << info->numChannels << endl;
         }
 
-        write(ossfd,
-              outbuf,
-              info->frameSize * sizeof(short) * info->numChannels);
-    } while (len > 0);
+        if (!StreamLayout(info, chunk->layout)) {
+            printf("Unsupported channel layout (%d channels)\n",
+                   info->numChannels);
+            break;
+        }
+
+        // Seek priming and the part of the frame before the join point
+        unsigned int frames = info->frameSize;
+        if (discard >= frames) {
+            discard -= frames;
+            continue;
+        }
+        if (discard > 0) {
+            memmove(chunk->pcm, chunk->pcm + discard * info->numChannels,
+                    (frames - discard) * info->numChannels * sizeof(int16_t));
+            frames -= discard;
+            discard = 0;
+        }
+
+        // A pending SEEK cuts the song here
+        int64_t stop = stopAt->load();
+        if (position + frames >= stop) {
+            frames = stop > position ? stop - position : 0;
+            ok = false;
+        }
+
+        if (frames > 0) {
+            chunk->type = PCM_CHUNK_DATA;
+            chunk->position = position;
+            chunk->gen = gen;
+            chunk->rate = info->sampleRate;
+            chunk->channels = info->numChannels;
+            chunk->frames = frames;
+            fan->commit();
+            chunk = nullptr;
+            position += frames;
+        }
+    } while (ok && len > 0);
 
     aacDecoder_Close(decoder);
+
+    return ok;
 }
 
 /*
@@ -183,33 +266,39 @@ main(int argc, const char *argv[])
         return 1;
     }
 
-    int ossfd = OpenAndConfigureOSS();
-
-    printf("DecodeAndPlay: len %d\n", len);
-    DecodeAndPlay(buf, len, ossfd);
+    PcmFanout fan(0);
+    atomic<int64_t> stopAt(INT64_MAX);
 
-    close(ossfd);
+    printf("DecodeSong: len %d\n", len);
+    DecodeSong(buf, len, 0, 0, 0, &stopAt, &fan);
 }
 */
 
-#define BUF_LEN (10 * 1024 * 1024)
-char buf[BUF_LEN];
-int buflen;
-
-
 int 
-load_song(int client, int msglen)
+load_song(int client, int msglen, Song *song)
 {
 	int offset = 0;
-	int status; 
+	int status = 0; 
+
+	if (msglen < 0 || msglen > SONG_LEN) {
+		printf("Song too large (%d bytes)\n", msglen);
+		return 1;
+	}
 	
 	while (offset < msglen) {
-		status = read(client, buf + offset, msglen - offset);
+		{
+			PERF_REGION(PERF_LOADREAD);
+			status = read(client, song->buf + offset,
+				      msglen - offset);
+		}
 		if (status < 0) {
 			perror("read");
 			printf("Intermediate offset:%d\n", offset);
 			return 1;
 		}
+		if (status == 0) {
+			break;
+		}
 		offset += status;
 	}
 	printf("Offset is: %d\n", offset);
@@ -220,80 +309,278 @@ load_song(int client, int msglen)
 		return 1;
 	}
 
-	buflen = msglen;
+	if (!song->index.build(song->buf, msglen)) {
+		printf("Song is not an ADTS stream\n");
+		return 1;
+	}
+
+	song->len = msglen;
 	printf("Final offset:%d\n", offset);
 
 	return 0;
  }
 
-int
-listen_to_commands(TimeSync *ts)
+static bool
+write_all(int fd, const void *buf, size_t len)
 {
-    int sock;
-    int status;
-    int ossfd;
-    int reuseaddr = 1;
-    int64_t timestamp = 0;
+	const char *p = (const char *)buf;
 
+	while (len > 0) {
+		ssize_t status = write(fd, p, len);
+		if (status < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			return false;
+		}
+		p += status;
+		len -= status;
+	}
 
-    sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (sock <0) {
-	perror("socket");
-	return 1;
-    }
-    
-    status = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
-                        &reuseaddr, sizeof(reuseaddr));
-    if (status < 0) {
-        perror("setsockopt");
-        abort();
-    }
-    
-    status = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
-                        &reuseaddr, sizeof(reuseaddr));
-    if (status < 0) {
-        perror("setsockopt");
-        abort();
-    }
+	return true;
+}
 
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-#define PORT (8085)
-    server_addr.sin_port = htons(PORT);
+static bool
+read_all(int fd, void *buf, size_t len)
+{
+	char *p = (char *)buf;
 
-    status = ::bind(sock, (struct sockaddr *) &server_addr, sizeof(server_addr));
-    if (status <0) {
-	perror("bind");
-	return 1;
-    }
+	while (len > 0) {
+		ssize_t status = read(fd, p, len);
+		if (status < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			return false;
+		}
+		if (status == 0)
+			return false;
+		p += status;
+		len -= status;
+	}
 
-#define BACKLOG_LEN (40)
-    status = listen(sock, BACKLOG_LEN);
-    if (status <0) {
-	perror("listen");
-	return 1;
-    }
+	return true;
+}
 
-    printf("Listening to port...\n");
-    struct sockaddr_in newconn;
-    int client;
-    socklen_t newconnlen;
-    for (;;) {
-	newconnlen = sizeof(newconn);
-	client = accept(sock, (struct sockaddr *) &newconn, &newconnlen);
-	if (status <0) {
-		perror("accept");
-		continue;
+/*
+ * relay_connect -- Connect to the next speaker in a relay chain, giving up
+ * after RELAY_CONNECT_TIMEOUT so a dead hop costs little.  Returns a blocking
+ * socket or -1.
+ */
+static int
+relay_connect(uint32_t ip)
+{
+	int fd;
+	int status;
+	int err = 0;
+	socklen_t errlen = sizeof(err);
+	int tos = MUSICPRINTER_TOS_BULK;
+	struct timeval tv = { RELAY_ACK_TIMEOUT, 0 };
+	struct sockaddr_in addr;
+	struct pollfd pfd;
+
+	fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
 	}
-	printf("Accepted connection.\n");
+
+	setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = ip;
+	addr.sin_port = htons(config.port);
+
+	status = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (status < 0 && errno != EINPROGRESS) {
+		perror("connect");
+		close(fd);
+		return -1;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	status = poll(&pfd, 1, RELAY_CONNECT_TIMEOUT);
+	if (status <= 0) {
+		printf("Relay hop %x: connect timed out\n", ip);
+		close(fd);
+		return -1;
+	}
+
+	getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+	if (err != 0) {
+		printf("Relay hop %x: %s\n", ip, strerror(err));
+		close(fd);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+	return fd;
+}
+
+/*
+ * relay_next -- Open the chain to the first reachable hop at or after *next
+ * and send it the RELAY header, the hops behind it and the have bytes of the
+ * song we already hold.  *next is left pointing behind the chosen hop.
+ * Returns the connection or -1 if no hop is left.
+ */
+static int
+relay_next(const vector<uint32_t> &hops, size_t *next, int len,
+	   const char *buf, int have)
+{
+	while (*next < hops.size()) {
+		uint32_t ip = hops[(*next)++];
+		uint32_t count = hops.size() - *next;
+		int hdr[3] = { (int)MUSICPRINTER_MAGIC, MUSICPRINTER_RELAY, len };
+		int fd;
+
+		fd = relay_connect(ip);
+		if (fd < 0)
+			continue;
+
+		if (write_all(fd, hdr, sizeof(hdr)) &&
+		    write_all(fd, &count, sizeof(count)) &&
+		    write_all(fd, hops.data() + *next, count * sizeof(uint32_t)) &&
+		    write_all(fd, buf, have)) {
+			printf("Relaying to %x, %u hops behind it\n", ip, count);
+			return fd;
+		}
+
+		printf("Relay hop %x failed, skipping it\n", ip);
+		close(fd);
+	}
+
+	return -1;
+}
+
+/*
+ * relay_song -- Receive a RELAY: store the song like a LOAD while passing
+ * every chunk on to the next hop as soon as it arrives.  A hop that fails is
+ * replaced by the one behind it, which is sent what we have so far and then
+ * follows the stream.  Returns 0 on success and fills loaded with the
+ * speakers down the chain that stored the song, this one first.  lead is
+ * raised to the largest lead reported from down the chain.
+ */
+static int
+relay_song(int client, int msglen, Song *song, vector<uint32_t> *loaded,
+	   int32_t *lead)
+{
+	uint32_t count;
+	vector<uint32_t> hops;
+	size_t next = 0;
+	int down;
+	int offset = 0;
+	int status = 0;
+	struct sockaddr_in self;
+	socklen_t selflen = sizeof(self);
+
+	if (!read_all(client, &count, sizeof(count)) ||
+	    count > MUSICPRINTER_RELAY_MAXHOPS) {
+		printf("Bad relay hop list\n");
+		return 1;
+	}
+	hops.resize(count);
+	if (!read_all(client, hops.data(), count * sizeof(uint32_t))) {
+		printf("Bad relay hop list\n");
+		return 1;
+	}
+
+	if (msglen < 0 || msglen > SONG_LEN) {
+		printf("Song too large (%d bytes)\n", msglen);
+		return 1;
+	}
+
+	down = relay_next(hops, &next, msglen, song->buf, 0);
+
+	while (offset < msglen) {
+		status = read(client, song->buf + offset,
+			      min(msglen - offset, RELAY_CHUNK));
+		if (status < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			break;
+		}
+		if (status == 0) {
+			break;
+		}
+
+		if (down >= 0 &&
+		    !write_all(down, song->buf + offset, status)) {
+			printf("Relay hop failed at offset %d, rerouting\n",
+			       offset);
+			close(down);
+			down = relay_next(hops, &next, msglen, song->buf,
+					  offset + status);
+		}
+		offset += status;
+	}
+
+	if (offset != msglen) {
+		printf("We didn't read enough bytes!\n");
+		// The next hop sees the connection close early and drops it too
+		if (down >= 0)
+			close(down);
+		return 1;
+	}
+
+	if (down >= 0) {
+		uint32_t n;
+
+		if (read_all(down, &n, sizeof(n)) &&
+		    n <= MUSICPRINTER_RELAY_MAXHOPS + 1) {
+			vector<uint32_t> ips(n);
+			int32_t downLead;
+
+			if (read_all(down, ips.data(), n * sizeof(uint32_t)) &&
+			    read_all(down, &downLead, sizeof(downLead))) {
+				loaded->insert(loaded->end(), ips.begin(), ips.end());
+				*lead = max(*lead, downLead);
+			}
+		} else {
+			printf("No relay acknowledgement from the next hop\n");
+		}
+		close(down);
+	}
+
+	if (!song->index.build(song->buf, msglen)) {
+		printf("Song is not an ADTS stream\n");
+		return 1;
+	}
+	song->len = msglen;
+
+	// Report ourselves under the address the sender used
+	getsockname(client, (struct sockaddr *)&self, &selflen);
+	loaded->insert(loaded->begin(), self.sin_addr.s_addr);
+
+	return 0;
+}
+
+/*
+ * serve_client -- Run the commands of one connection until it closes.
+ */
+static void
+serve_client(int client, TimeSync *ts, Player *player)
+{
+	int status;
+	int64_t timestamp = 0;
+	Song *song;
 
 	for (;;) {
 		unsigned int poison;
 		status = read(client, &poison, sizeof(poison));
 		if (status < 0) {
 			perror("read");
-			return 1;
+			break;
+		}
+		if (status == 0) {
+			printf("Connection closed, breaking out...\n");
+			break;
 		}
 		if (poison != 0xaa55aa55) {
 			printf("Error: Poison value received is %x\n", poison);
@@ -304,7 +591,7 @@ listen_to_commands(TimeSync *ts)
 		status = read(client, &cmd, sizeof(cmd));
 		if (status < 0) {
 			perror("read");
-			return 1;
+			break;
 		}
 		if (status == 0) {
 			printf("Connection closed, breaking out...\n");
@@ -315,16 +602,45 @@ listen_to_commands(TimeSync *ts)
 		status = read(client, &arg, sizeof(arg));
 		if (status < 0) {
 			perror("read");
-			return 1;
+			break;
 		}
 
 
 		printf("Read cmd %d, arg %d\n", cmd, arg);
 		switch (cmd) {
-			case MUSICPRINTER_LOAD:
-				status = load_song(client, arg);
+			case MUSICPRINTER_LOAD: {
+				int32_t lead;
+
+				song = player->acquire();
+				ts->beginTransfer();
+				status = load_song(client, arg, song);
+				ts->endTransfer();
+				player->loaded(song, status == 0);
+
+				lead = status == 0 ? player->getLead() : -1;
+				write_all(client, &lead, sizeof(lead));
+
+				break;
+			}
+
+			case MUSICPRINTER_RELAY: {
+				vector<uint32_t> loaded;
+				uint32_t n;
+				int32_t lead = player->getLead();
+
+				song = player->acquire();
+				ts->beginTransfer();
+				status = relay_song(client, arg, song, &loaded, &lead);
+				ts->endTransfer();
+				player->loaded(song, status == 0);
+
+				n = loaded.size();
+				write_all(client, &n, sizeof(n));
+				write_all(client, loaded.data(), n * sizeof(uint32_t));
+				write_all(client, &lead, sizeof(lead));
 
 				break;
+			}
 
 			case MUSICPRINTER_GETTIME:
 				timestamp = ts->getTime();
@@ -333,12 +649,22 @@ listen_to_commands(TimeSync *ts)
 				break;
 			case MUSICPRINTER_PLAY:
 				read(client, &timestamp, sizeof(timestamp));
-				ts->sleepUntil(timestamp);
+				player->play(timestamp);
+				break;
 
-    				ossfd = OpenAndConfigureOSS();
-				DecodeAndPlay(buf, buflen, ossfd);
-				printf("DecodeAndPlay: len %d\n", arg);
-				close(ossfd);
+			case MUSICPRINTER_PAUSE:
+				read_all(client, &timestamp, sizeof(timestamp));
+				player->pause(timestamp);
+				break;
+
+			case MUSICPRINTER_RESUME:
+				read_all(client, &timestamp, sizeof(timestamp));
+				player->resume(timestamp);
+				break;
+
+			case MUSICPRINTER_SEEK:
+				read_all(client, &timestamp, sizeof(timestamp));
+				player->seek(timestamp, (int64_t)arg * 1000);
 				break;
 
 			default:
@@ -347,6 +673,75 @@ listen_to_commands(TimeSync *ts)
 		}
 
 	}
-    }
+
+	close(client);
 }
 
+int
+listen_to_commands(TimeSync *ts, Player *player)
+{
+    int sock;
+    int status;
+    int reuseaddr = 1;
+
+    sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock <0) {
+	perror("socket");
+	return 1;
+    }
+    
+    status = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
+                        &reuseaddr, sizeof(reuseaddr));
+    if (status < 0) {
+        perror("setsockopt");
+        abort();
+    }
+    
+    status = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+                        &reuseaddr, sizeof(reuseaddr));
+    if (status < 0) {
+        perror("setsockopt");
+        abort();
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (config.bindAddr[0] != '\0' &&
+        inet_pton(AF_INET, config.bindAddr, &server_addr.sin_addr) != 1) {
+        printf("Invalid bind address %s\n", config.bindAddr);
+        return 1;
+    }
+    server_addr.sin_port = htons(config.port);
+
+    status = ::bind(sock, (struct sockaddr *) &server_addr, sizeof(server_addr));
+    if (status <0) {
+	perror("bind");
+	return 1;
+    }
+
+#define BACKLOG_LEN (40)
+    status = listen(sock, BACKLOG_LEN);
+    if (status <0) {
+	perror("listen");
+	return 1;
+    }
+
+    printf("Listening to port...\n");
+    struct sockaddr_in newconn;
+    int client;
+    socklen_t newconnlen;
+    for (;;) {
+	newconnlen = sizeof(newconn);
+	client = accept(sock, (struct sockaddr *) &newconn, &newconnlen);
+	if (client <0) {
+		perror("accept");
+		continue;
+	}
+	printf("Accepted connection.\n");
+
+	// lpr-music and relaying peers hold connections open concurrently
+	thread(serve_client, client, ts, player).detach();
+    }
+}
@@ -0,0 +1,23 @@
+
+#ifndef __SPEAKER_H__
+#define __SPEAKER_H__
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include "fanout.h"
+#include "player.h"
+#include "timesync.h"
+
+#define RELAY_CHUNK             (16 * 1024)     // Forwarded per read
+#define RELAY_CONNECT_TIMEOUT   500     // Before skipping a hop (ms)
+#define RELAY_ACK_TIMEOUT       30      // For the rest of the chain (s)
+
+bool DecodeSong(char *buf, unsigned int len, unsigned int discard,
+                int64_t position, uint32_t gen,
+                const std::atomic<int64_t> *stopAt, PcmFanout *fan);
+int listen_to_commands(TimeSync *ts, Player *player);
+
+#endif /* __SPEAKER_H__ */
+
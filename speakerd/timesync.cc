@@ -19,48 +19,63 @@
  * solutions but a simple one is for us to take many measurements and take the 
  * smallest network latency of all.
  *
+ * Song transfers break that assumption: a LOAD fills the queues on the path
+ * for seconds and every sample taken meanwhile is late.  Speakers flag their
+ * announcements while receiving a song (and for TIMESYNC_BUSY_HOLD after) and
+ * samples that are flagged on either end only count when a machine has no
+ * clean samples at all.  Announcements are also marked DSCP EF so networks
+ * that honour it send them ahead of the transfer.
+ *
+ * A restarted speaker would need many rounds before the minimums are good
+ * again.  Every TIMESYNC_SAVE_INTERVAL the time delta and skew of every peer
+ * are checkpointed to a state file (-s).  On startup they become priors,
+ * predicted forward by their skew with an error that grows with their age,
+ * and a few samples that agree with a prior are enough to play in sync.  Each
+ * clock carries an epoch (see ClockEpoch()), a prior or a sample history from
+ * another epoch of either clock is thrown away.
+ *
  */
 
 #include <iostream>
 
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 
 #include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <net/if.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
+#include "clock.h"
+#include "perf.h"
+#include "printer.h"
+#include "realtime.h"
 #include "timesync.h"
 
 using namespace std;
 
 /*
- * XXX: Set to the local broadcast address of the network.  Run ifconfig to see 
- * the broadcast address for the local area network where all the machines run 
- * on.  You can also broadcast to 255.255.255.255 but machines with multiple 
- * NICs may not route the packet to the correct network.
- */
-static char bcIP[] = "129.97.75.255";
-
-#define TIMESYNC_PORT 8086
-
-/*
- * machineTime -- Get local time in microseconds.
+ * machineTime -- Get local time in microseconds from the selected clock
+ * source, see clock.h.
  */
-static int64_t
+static inline int64_t
 machineTime()
 {
-    struct timeval tp;
-    struct timezone tzp;
-
-    gettimeofday(&tp, &tzp);
-
-    return tp.tv_sec * 1000000 + tp.tv_usec;
+    return ClockNow();
 }
 
-TSMachine::TSMachine(uint32_t ip) : ip(ip), ts()
+TSMachine::TSMachine(uint32_t ip)
+    : tdpeer(0), latency(0), ip(ip), lastSeen(0), epoch(0), clean(0),
+      hasPrior(false), prior(), skewTD(0), skewAt(0), skew(0),
+      skewValid(false), ts()
 {
 }
 
@@ -76,23 +91,178 @@ TSMachine::dump()
     inet_ntop(AF_INET, &ip, ipStr, INET_ADDRSTRLEN);
 
     cout << "Machine " << ipStr << endl;
-    cout << "    TD " << getTSDelta() << " RemoteTD " << tdpeer << endl;
+    cout << "    TD " << getTSDelta() << " RemoteTD " << tdpeer
+         << " Latency " << latency << " Skew " << skew
+         << (hasPrior ? " (prior)" : "") << endl;
 }
 
 void
-TSMachine::addSample(int64_t localts, int64_t remotets)
+TSMachine::addSample(int64_t localts, int64_t remotets, bool busy,
+                     uint32_t peerEpoch)
 {
+    int64_t td = localts - remotets;
+    int64_t pred, err;
+
+    // The peer's clock restarted, its old deltas mean nothing now
+    if (peerEpoch != epoch) {
+        if (!ts.empty()) {
+            ts.clear();
+            clean = 0;
+            skewAt = 0;
+            skewValid = false;
+            dropPrior("peer clock restarted");
+        }
+        epoch = peerEpoch;
+    }
+    if (hasPrior && prior.epoch != peerEpoch)
+        dropPrior("peer clock restarted");
+
+    // Samples are late, never early, one below the prior's range refutes it
+    if (hasPrior) {
+        if (!predict(&pred, &err))
+            dropPrior("too old");
+        else if (td < pred - err)
+            dropPrior("contradicted by a sample");
+    }
+
     lastSeen = machineTime();
-    ts.push_front((localts - remotets));
+    ts.push_front(Sample{ td, busy });
+    if (!busy)
+        clean++;
     if (ts.size() > 120) {
+        if (!ts.back().busy)
+            clean--;
         ts.pop_back();
     }
+
+    if (hasPrior && clean >= TIMESYNC_WARM_SAMPLES)
+        dropPrior("enough samples");
+}
+
+/*
+ * setPrior -- Start from a checkpointed time delta until samples take over.
+ */
+void
+TSMachine::setPrior(const TSPrior &p)
+{
+    prior = p;
+    hasPrior = true;
+    skew = p.skew;
+    skewValid = true;
+}
+
+/*
+ * predict -- The prior's time delta and error now.  Returns false once the
+ * error has grown past TIMESYNC_PRIOR_MAXERR.
+ */
+bool
+TSMachine::predict(int64_t *td, int64_t *err)
+{
+    int64_t age = machineTime() - prior.at;
+
+    *td = prior.td + (int64_t)(prior.skew * age / 1000000);
+    *err = prior.err + (int64_t)TIMESYNC_PRIOR_DRIFT * age / 1000000;
+
+    return *err <= TIMESYNC_PRIOR_MAXERR;
+}
+
+void
+TSMachine::dropPrior(const char *why)
+{
+    char ipStr[INET_ADDRSTRLEN];
+
+    if (!hasPrior)
+        return;
+
+    inet_ntop(AF_INET, &ip, ipStr, INET_ADDRSTRLEN);
+    printf("timesync: dropping prior for %s, %s\n", ipStr, why);
+    hasPrior = false;
+}
+
+/*
+ * updateSkew -- Track how fast the time delta moves, once the minimum is
+ * trustworthy.  Called every TIMESYNC_SAVE_INTERVAL.
+ */
+void
+TSMachine::updateSkew()
+{
+    int64_t now = machineTime();
+    int64_t td;
+    double inst;
+
+    if (clean < TIMESYNC_WARM_SAMPLES)
+        return;
+
+    td = getTSDelta();
+    if (skewAt == 0) {
+        skewTD = td;
+        skewAt = now;
+        return;
+    }
+    if (now - skewAt < TIMESYNC_SKEW_INTERVAL)
+        return;
+
+    inst = (double)(td - skewTD) * 1000000 / (now - skewAt);
+    if (inst > TIMESYNC_MAX_SKEW)
+        inst = TIMESYNC_MAX_SKEW;
+    if (inst < -TIMESYNC_MAX_SKEW)
+        inst = -TIMESYNC_MAX_SKEW;
+
+    skew = skewValid ? 0.75 * skew + 0.25 * inst : inst;
+    skewValid = true;
+    skewTD = td;
+    skewAt = now;
+}
+
+/*
+ * getState -- What to checkpoint for this machine, false if nothing useful.
+ * A machine still leaning on its prior carries the prior's error forward.
+ */
+bool
+TSMachine::getState(TSPrior *p)
+{
+    int64_t td;
+
+    p->err = 0;
+    if (clean < TIMESYNC_WARM_SAMPLES) {
+        if (!hasPrior || !predict(&td, &p->err))
+            return false;
+    }
+
+    p->td = getTSDelta();
+    p->skew = skewValid ? skew : 0;
+    p->at = machineTime();
+    p->epoch = epoch;
+
+    return true;
+}
+
+/*
+ * isSynced -- Enough samples for the minimum to stand on its own, or a few
+ * that agree with the prior.
+ */
+bool
+TSMachine::isSynced()
+{
+    if (clean >= TIMESYNC_WARM_SAMPLES)
+        return true;
+
+    return hasPrior && (int)ts.size() >= TIMESYNC_PRIOR_SAMPLES;
 }
 
 bool
 TSMachine::isLive() 
 {
-    return (machineTime() - lastSeen) < (5 * 1000000);
+    return getAge() < TIMESYNC_LIVENESS;
+}
+
+/*
+ * getAge -- Microseconds since the last announcement from this machine.
+ */
+int64_t
+TSMachine::getAge()
+{
+    return machineTime() - lastSeen;
 }
 
 uint32_t
@@ -101,21 +271,48 @@ TSMachine::getIP()
     return ip;
 }
 
+/*
+ * getTSDelta -- Minimum time delta over the samples not taken during a song
+ * transfer, or over all of them if there are no such samples.  While there is
+ * a prior, the minimum of few samples is still likely high and the prior
+ * caps it.
+ */
 int64_t
 TSMachine::getTSDelta()
 {
     int64_t min = INT64_MAX;
+    int64_t busyMin = INT64_MAX;
     for (auto &&s : ts) {
-        if (min > s) {
-            min = s;
+        if (s.busy) {
+            if (busyMin > s.td)
+                busyMin = s.td;
+        } else if (min > s.td) {
+            min = s.td;
         }
     }
+    if (min == INT64_MAX)
+        min = busyMin;
+
+    if (hasPrior) {
+        int64_t pred, err;
+
+        if (predict(&pred, &err) && pred < min)
+            min = pred;
+    }
+
     return min;
 }
 
 TimeSync::TimeSync()
-    : done(false), myIP(0xffffffff), thrAnnounce(nullptr), thrSync(nullptr), machines()
+    : done(false), rtPriority(0), rtCpu(-1), myIP(0xffffffff),
+      bindIP(htonl(INADDR_ANY)), peers(), port(TIMESYNC_PORT), group(0),
+      latency(0), transfers(0), busyUntil(0), epoch(0), state(), priors(),
+      thrAnnounce(nullptr), thrSync(nullptr), machines()
 {
+    uint32_t bc;
+
+    inet_pton(AF_INET, TIMESYNC_BROADCAST, &bc);
+    peers.push_back(bc);
 }
 
 TimeSync::~TimeSync()
@@ -127,11 +324,310 @@ TimeSync::~TimeSync()
 void
 TimeSync::start()
 {
+    epoch = ClockEpoch();
+    loadState();
+
     done = false;
     thrAnnounce = new thread(&TimeSync::announcer, this);
     thrSync = new thread(&TimeSync::listener, this);
 }
 
+/*
+ * setRealtime -- Run the announcer and listener under SCHED_FIFO at priority
+ * (pinned to cpu when cpu >= 0).  Must be called before start().
+ */
+void
+TimeSync::setRealtime(int priority, int cpu)
+{
+    rtPriority = priority;
+    rtCpu = cpu;
+}
+
+/*
+ * setRegistry -- Publish the list of live speakers to path once a second so
+ * lpr-music can find them without waiting for an announcement.
+ */
+void
+TimeSync::setRegistry(const string &path)
+{
+    registry = path;
+}
+
+/*
+ * setLatency -- Advertise the output latency this speaker compensates for at
+ * PLAY, so other hosts can see how far apart the hardware is.
+ */
+void
+TimeSync::setLatency(int64_t us)
+{
+    latency = (int32_t)us;
+}
+
+/*
+ * setState -- Checkpoint the clock model to path and warm start from it, ""
+ * disables.  Must be called before start().
+ */
+void
+TimeSync::setState(const string &path)
+{
+    state = path;
+}
+
+/*
+ * loadState -- Turn the checkpoint into priors.  The file starts with
+ * "epoch EPOCH saved WALLCLOCK_US" followed by one "ip td_us skew_ppm epoch
+ * err_us" line per machine, err_us being missing from older checkpoints.  A
+ * checkpoint of another local clock epoch is ignored.
+ */
+void
+TimeSync::loadState()
+{
+    FILE *f;
+    char line[128];
+    unsigned int savedEpoch;
+    long long saved;
+    int64_t age;
+    struct timeval tv;
+
+    if (state.empty())
+        return;
+
+    f = fopen(state.c_str(), "r");
+    if (f == nullptr) {
+        if (errno != ENOENT)
+            perror("fopen timesync state");
+        return;
+    }
+
+    if (fgets(line, sizeof(line), f) == nullptr ||
+        sscanf(line, "epoch %x saved %lld", &savedEpoch, &saved) != 2) {
+        printf("timesync: %s is not a state file\n", state.c_str());
+        fclose(f);
+        return;
+    }
+    if (savedEpoch != epoch) {
+        printf("timesync: local clock changed since the checkpoint\n");
+        fclose(f);
+        return;
+    }
+
+    gettimeofday(&tv, nullptr);
+    age = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec - saved;
+    if (age < 0 ||
+        TIMESYNC_PRIOR_ERROR + TIMESYNC_PRIOR_DRIFT * age / 1000000 >
+        TIMESYNC_PRIOR_MAXERR) {
+        printf("timesync: checkpoint too old\n");
+        fclose(f);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), f) != nullptr) {
+        char ipStr[INET_ADDRSTRLEN];
+        long long td;
+        long long err = 0;
+        double skew;
+        unsigned int peerEpoch;
+        uint32_t ip;
+        TSPrior p;
+
+        if (sscanf(line, "%15s %lld %lf %x %lld", ipStr, &td, &skew,
+                   &peerEpoch, &err) < 4)
+            continue;
+        if (inet_pton(AF_INET, ipStr, &ip) != 1)
+            continue;
+
+        p.td = td + (int64_t)(skew * age / 1000000);
+        p.skew = skew;
+        p.err = err + TIMESYNC_PRIOR_ERROR +
+                TIMESYNC_PRIOR_DRIFT * age / 1000000;
+        if (err < 0 || p.err > TIMESYNC_PRIOR_MAXERR)
+            continue;
+        p.at = machineTime();
+        p.epoch = peerEpoch;
+        priors[ip] = p;
+    }
+    fclose(f);
+
+    printf("timesync: %zu priors from a %lld ms old checkpoint\n",
+           priors.size(), (long long)(age / 1000));
+}
+
+/*
+ * saveState -- Checkpoint every machine with a usable time delta.
+ */
+void
+TimeSync::saveState()
+{
+    FILE *f;
+    string tmp;
+    char ipStr[INET_ADDRSTRLEN];
+    struct timeval tv;
+    vector<pair<uint32_t, TSPrior>> rows;
+
+    if (state.empty())
+        return;
+
+    {
+        lock_guard<mutex> lk(lock);
+        for (auto &&m : machines) {
+            TSPrior p;
+
+            m.second.updateSkew();
+            if (!m.second.getState(&p))
+                continue;
+            rows.push_back(make_pair(m.first, p));
+        }
+    }
+
+    tmp = state + ".tmp." + to_string(getpid());
+    f = fopen(tmp.c_str(), "w");
+    if (f == nullptr) {
+        perror("fopen timesync state");
+        return;
+    }
+
+    gettimeofday(&tv, nullptr);
+    fprintf(f, "epoch %08x saved %lld\n", epoch,
+            (long long)tv.tv_sec * 1000000 + tv.tv_usec);
+    for (auto &&r : rows) {
+        inet_ntop(AF_INET, &r.first, ipStr, INET_ADDRSTRLEN);
+        fprintf(f, "%s %lld %.3f %08x %lld\n", ipStr,
+                (long long)r.second.td, r.second.skew, r.second.epoch,
+                (long long)r.second.err);
+    }
+
+    if (fclose(f) != 0 || rename(tmp.c_str(), state.c_str()) < 0) {
+        perror("write timesync state");
+        unlink(tmp.c_str());
+    }
+}
+
+/*
+ * isSynced -- Whether getTime() can be trusted for playback yet.
+ */
+bool
+TimeSync::isSynced()
+{
+    uint32_t ref = UINT32_MAX;
+    lock_guard<mutex> lk(lock);
+
+    for (auto &&m : machines) {
+        if (m.first < ref)
+            ref = m.first;
+    }
+    if (ref == UINT32_MAX)
+        return false;
+
+    return machines[ref].isSynced();
+}
+
+/*
+ * beginTransfer -- A song transfer to this speaker started, see isBusy().
+ */
+void
+TimeSync::beginTransfer()
+{
+    transfers++;
+}
+
+void
+TimeSync::endTransfer()
+{
+    busyUntil = machineTime() + TIMESYNC_BUSY_HOLD;
+    transfers--;
+}
+
+/*
+ * isBusy -- True while a song transfer is running or has just finished and
+ * queues along its path may not have drained yet.
+ */
+bool
+TimeSync::isBusy()
+{
+    return transfers > 0 || machineTime() < busyUntil;
+}
+
+/*
+ * setNetwork -- Where to bind, where announcements go and which group to
+ * follow.  peers is a comma separated list of broadcast, unicast or multicast
+ * addresses.  Must be called before start().
+ */
+bool
+TimeSync::setNetwork(const string &bind, const string &peerList, int syncPort,
+                     uint32_t syncGroup)
+{
+    vector<uint32_t> addrs;
+    size_t pos = 0;
+
+    if (!bind.empty() && inet_pton(AF_INET, bind.c_str(), &bindIP) != 1) {
+        printf("Invalid bind address %s\n", bind.c_str());
+        return false;
+    }
+
+    while (pos <= peerList.size()) {
+        size_t end = peerList.find(',', pos);
+        string peer;
+        uint32_t addr;
+
+        if (end == string::npos)
+            end = peerList.size();
+        peer = peerList.substr(pos, end - pos);
+        pos = end + 1;
+
+        if (peer.empty())
+            continue;
+        if (inet_pton(AF_INET, peer.c_str(), &addr) != 1) {
+            printf("Invalid peer address %s\n", peer.c_str());
+            return false;
+        }
+        addrs.push_back(addr);
+    }
+
+    if (addrs.empty()) {
+        printf("No time sync peers\n");
+        return false;
+    }
+
+    peers = addrs;
+    port = syncPort;
+    group = syncGroup;
+
+    return true;
+}
+
+/*
+ * isGroupAddr -- True for multicast and broadcast addresses, which are only
+ * delivered to sockets bound to the wildcard address.
+ */
+bool
+TimeSync::isGroupAddr(uint32_t addr)
+{
+    struct ifaddrs *ifs;
+    bool found = false;
+
+    if (IN_MULTICAST(ntohl(addr)) || addr == htonl(INADDR_BROADCAST))
+        return true;
+
+    if (getifaddrs(&ifs) < 0)
+        return false;
+
+    for (struct ifaddrs *i = ifs; i != nullptr; i = i->ifa_next) {
+        struct sockaddr_in *bc = (struct sockaddr_in *)i->ifa_broadaddr;
+
+        if ((i->ifa_flags & IFF_BROADCAST) == 0 || bc == nullptr ||
+            i->ifa_addr == nullptr || i->ifa_addr->sa_family != AF_INET)
+            continue;
+        if (bc->sin_addr.s_addr == addr) {
+            found = true;
+            break;
+        }
+    }
+
+    freeifaddrs(ifs);
+
+    return found;
+}
+
 void
 TimeSync::stop()
 {
@@ -144,13 +640,17 @@ TimeSync::stop()
     thrSync->join();
     delete thrSync;
     thrSync = nullptr;
+
+    saveState();
 }
 
 int64_t
 TimeSync::getTime()
 {
+    PERF_REGION(PERF_GETTIME);
     auto min = UINT32_MAX;
     TSMachine min_machine;
+    lock_guard<mutex> lk(lock);
     for (auto &&m : machines) {
         uint32_t curr = m.second.getIP();
         if(curr < min) {
@@ -174,21 +674,95 @@ TimeSync::sleepUntil(int64_t ts)
 void
 TimeSync::dump()
 {
+    lock_guard<mutex> lk(lock);
     for (auto &&m : machines) {
         m.second.dump();
     }
 }
 
+/*
+ * writeRegistry -- Write the live speakers and how long ago we heard from
+ * them.  The list goes to a fresh temporary file (mkstemp, never an existing
+ * file or symlink) that is renamed into place so readers never see a partial
+ * list.
+ */
+void
+TimeSync::writeRegistry()
+{
+    static bool warned = false;
+    FILE *f;
+    int fd;
+    string tmp;
+    char ipStr[INET_ADDRSTRLEN];
+
+    if (registry.empty())
+        return;
+
+    tmp = registry + ".XXXXXX";
+    fd = mkstemp(&tmp[0]);
+    if (fd < 0) {
+        // Once, not every second
+        if (!warned)
+            perror("mkstemp registry");
+        warned = true;
+        return;
+    }
+    fchmod(fd, 0644);
+    f = fdopen(fd, "w");
+    if (f == nullptr) {
+        perror("fdopen registry");
+        close(fd);
+        unlink(tmp.c_str());
+        return;
+    }
+
+    fprintf(f, "# ip age_ms latency_us\n");
+    {
+        lock_guard<mutex> lk(lock);
+        for (auto &&m : machines) {
+            uint32_t ip = m.first;
+
+            if (!m.second.isLive())
+                continue;
+
+            inet_ntop(AF_INET, &ip, ipStr, INET_ADDRSTRLEN);
+            fprintf(f, "%s %lld %d\n", ipStr,
+                    (long long)(m.second.getAge() / 1000), m.second.latency);
+        }
+    }
+
+    if (fclose(f) != 0) {
+        perror("fclose registry");
+        unlink(tmp.c_str());
+        return;
+    }
+
+    if (rename(tmp.c_str(), registry.c_str()) < 0) {
+        perror("rename registry");
+        unlink(tmp.c_str());
+    }
+}
+
 void
 TimeSync::announcer()
 {
     int fd;
     int status;
     int broadcast = 1;
+    int tos = MUSICPRINTER_TOS_SYNC;
+    unsigned char ttl = 1;
+    unsigned char loop = 1;
     socklen_t srcAddrLen;
     struct sockaddr_in srcAddr;
     char srcStr[INET_ADDRSTRLEN];
     struct sockaddr_in dstAddr;
+    int64_t started = machineTime();
+    bool synced = false;
+    unsigned int rounds = 0;
+
+    if (rtPriority > 0) {
+        RTConfigureThread("timesync announcer", rtPriority, rtCpu);
+    }
 
     fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     if (fd < 0) {
@@ -203,49 +777,132 @@ TimeSync::announcer()
         abort();
     }
 
-    memset(&dstAddr, 0, sizeof(dstAddr));
-    dstAddr.sin_family = AF_INET;
-    inet_pton(AF_INET, bcIP, &dstAddr.sin_addr.s_addr);
-    dstAddr.sin_port = htons(TIMESYNC_PORT);
+    // Ahead of song transfers where the network honours DSCP
+    status = setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+    if (status < 0) {
+        perror("setsockopt IP_TOS");
+    }
 
-    // Figure out our IP
-    status = ::connect(fd, (struct sockaddr *)&dstAddr, sizeof(dstAddr));
+    // Multicast stays on this host's subnet and loops back to local listeners
+    status = setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    if (status < 0) {
+        perror("setsockopt");
+        abort();
+    }
+    status = setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
     if (status < 0) {
-        perror("connect");
+        perror("setsockopt");
         abort();
     }
 
-    srcAddrLen = sizeof(srcAddr);
-    getsockname(fd, (struct sockaddr *)&srcAddr, &srcAddrLen);
-    inet_ntop(AF_INET, &srcAddr.sin_addr.s_addr, srcStr, sizeof(srcStr));
+    /*
+     * Bind to our address so announcements carry it as their source, this is
+     * how instances sharing a host tell each other apart.
+     */
+    if (bindIP != htonl(INADDR_ANY)) {
+        struct in_addr mcIf;
+
+        memset(&srcAddr, 0, sizeof(srcAddr));
+        srcAddr.sin_family = AF_INET;
+        srcAddr.sin_addr.s_addr = bindIP;
+        srcAddr.sin_port = 0;
+        status = ::bind(fd, (struct sockaddr *)&srcAddr, sizeof(srcAddr));
+        if (status < 0) {
+            perror("bind");
+            abort();
+        }
+
+        mcIf.s_addr = bindIP;
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &mcIf, sizeof(mcIf));
+
+        myIP = bindIP;
+    } else {
+        int probe;
+
+        // Figure out our IP from the route to the first peer
+        probe = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (probe < 0) {
+            perror("socket");
+            abort();
+        }
+        setsockopt(probe, SOL_SOCKET, SO_BROADCAST,
+                   &broadcast, sizeof(broadcast));
+
+        memset(&dstAddr, 0, sizeof(dstAddr));
+        dstAddr.sin_family = AF_INET;
+        dstAddr.sin_addr.s_addr = peers[0];
+        dstAddr.sin_port = htons(port);
+        status = ::connect(probe, (struct sockaddr *)&dstAddr,
+                           sizeof(dstAddr));
+        if (status < 0) {
+            perror("connect");
+            abort();
+        }
+
+        srcAddrLen = sizeof(srcAddr);
+        getsockname(probe, (struct sockaddr *)&srcAddr, &srcAddrLen);
+        close(probe);
+        myIP = srcAddr.sin_addr.s_addr;
+    }
+
+    inet_ntop(AF_INET, &myIP, srcStr, sizeof(srcStr));
     cout << "Local IP: " << srcStr << endl;
-    myIP = srcAddr.sin_addr.s_addr;
+
+    memset(&dstAddr, 0, sizeof(dstAddr));
+    dstAddr.sin_family = AF_INET;
+    dstAddr.sin_port = htons(port);
 
     while (!done) {
         int i = 0;
         TSPkt pkt;
 
+        memset(&pkt, 0, sizeof(pkt));
         pkt.magic = TIMESYNC_MAGIC;
+        pkt.group = group;
+        pkt.version = TSPKT_VERSION;
+        pkt.latency = latency;
+        pkt.flags = isBusy() ? TSPKT_BUSY : 0;
+        pkt.epoch = epoch;
         pkt.ts = machineTime();
-        for (i = 0; i < 32; i++) {
-            pkt.machines[i].ip = 0;
-            pkt.machines[i].td = 0;
-        }
+
+        // Only advertise live machines so listeners never see dead peers
         i = 0;
+        lock.lock();
         for (auto &&m : machines) {
+            if (i == TIMESYNC_MACHINES)
+                break;
+            if (!m.second.isLive())
+                continue;
             pkt.machines[i].ip = m.first;
+            pkt.machines[i].age = (uint32_t)(m.second.getAge() / 1000);
             pkt.machines[i].td = m.second.getTSDelta();
             i++;
         }
+        lock.unlock();
 
-        status = (int)send(fd, (char *)&pkt, sizeof(pkt), 0);
-        if (status < 0) {
-            perror("sendto");
+        for (auto &&peer : peers) {
+            dstAddr.sin_addr.s_addr = peer;
+            status = (int)sendto(fd, (char *)&pkt, sizeof(pkt), 0,
+                                 (struct sockaddr *)&dstAddr, sizeof(dstAddr));
+            if (status < 0) {
+                perror("sendto");
+            }
         }
 
         //cout << "Announcement Sent" << endl;
         //dump();
 
+        writeRegistry();
+        ClockRecalibrate();
+
+        if (!synced && isSynced()) {
+            synced = true;
+            printf("timesync: synchronized after %lld ms\n",
+                   (long long)((machineTime() - started) / 1000));
+        }
+        if (++rounds % TIMESYNC_SAVE_INTERVAL == 0)
+            saveState();
+
         sleep(1);
     }
 }
@@ -253,6 +910,7 @@ TimeSync::announcer()
 void
 TimeSync::processPkt(uint32_t src, const TSPkt &pkt)
 {
+    PERF_REGION(PERF_PROCESSPKT);
     int64_t ts = machineTime();
 
     if (pkt.magic != TIMESYNC_MAGIC) {
@@ -260,11 +918,25 @@ TimeSync::processPkt(uint32_t src, const TSPkt &pkt)
         return;
     }
 
+    // Another cluster sharing the network or host
+    if (pkt.group != group)
+        return;
+
+    lock_guard<mutex> lk(lock);
     if (machines.find(src) == machines.end()) {
+        auto p = priors.find(src);
+
         machines[src] = TSMachine(src);
+        if (p != priors.end()) {
+            machines[src].setPrior(p->second);
+            priors.erase(p);
+        }
     }
 
-    machines[src].addSample(ts, pkt.ts);
+    machines[src].addSample(ts, pkt.ts,
+                            (pkt.flags & TSPKT_BUSY) != 0 || isBusy(),
+                            pkt.epoch);
+    machines[src].latency = pkt.latency;
 
     for (int i = 0; i < TIMESYNC_MACHINES; i++) {
         if (pkt.machines[i].ip == myIP) {
@@ -282,6 +954,10 @@ TimeSync::listener()
     int reuseaddr = 1;
     int broadcast = 1;
 
+    if (rtPriority > 0) {
+        RTConfigureThread("timesync listener", rtPriority, rtCpu);
+    }
+
     // Create a network socket
     fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     if (fd < 0) {
@@ -316,11 +992,22 @@ TimeSync::listener()
         abort();
     }
 
+    /*
+     * Unicast peers are received on our own address so that instances sharing
+     * a host each get their copy.  Broadcast and multicast are only delivered
+     * to the wildcard address.
+     */
+    bool wildcard = (bindIP == htonl(INADDR_ANY));
+    for (auto &&peer : peers) {
+        if (isGroupAddr(peer))
+            wildcard = true;
+    }
+
     memset(&addr, 0, sizeof(addr));
 
     addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(TIMESYNC_PORT);
+    addr.sin_addr.s_addr = wildcard ? htonl(INADDR_ANY) : bindIP;
+    addr.sin_port = htons(port);
 
     // Bind to the address/port we want to listen to
     status = ::bind(fd, (struct sockaddr *)&addr, sizeof(addr));
@@ -329,6 +1016,22 @@ TimeSync::listener()
         abort();
     }
 
+    for (auto &&peer : peers) {
+        struct ip_mreq mreq;
+
+        if (!IN_MULTICAST(ntohl(peer)))
+            continue;
+
+        mreq.imr_multiaddr.s_addr = peer;
+        mreq.imr_interface.s_addr = bindIP;
+        status = setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                            &mreq, sizeof(mreq));
+        if (status < 0) {
+            perror("setsockopt IP_ADD_MEMBERSHIP");
+            abort();
+        }
+    }
+
     while (!done) {
         TSPkt pkt;
         ssize_t bufLen = sizeof(pkt);
@@ -336,6 +1039,9 @@ TimeSync::listener()
         socklen_t srcAddrLen = sizeof(srcAddr);
         char srcAddrStr[INET_ADDRSTRLEN];
 
+        // Fields an older sender does not have read as zero
+        memset(&pkt, 0, sizeof(pkt));
+
         // Receive a single packet
         bufLen = recvfrom(fd, (void *)&pkt, (size_t)bufLen, 0,
                        (struct sockaddr *)&srcAddr, &srcAddrLen);
@@ -343,7 +1049,7 @@ TimeSync::listener()
             perror("recvfrom");
             continue;
         }
-        if (bufLen != sizeof(pkt)) {
+        if (bufLen < (ssize_t)TSPKT_MINLEN) {
             cout << "Packet with the wrong size!" << endl;
             continue;
         }
@@ -2,44 +2,129 @@
 #ifndef __TIMESYNC_H__
 #define __TIMESYNC_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
 #include <list>
+#include <map>
+#include <mutex>
+#include <string>
 #include <unordered_map>
 #include <thread>
+#include <vector>
 
 struct TSPktMachine
 {
     uint32_t ip;    // IP of Other Machine
+    uint32_t age;   // Milliseconds since we last heard from it
     int64_t td;     // Minimum Time Delta
 };
 
+// Machines we have not heard from for this long are considered dead
+#define TIMESYNC_LIVENESS   (5 * 1000000)
+
 #define TIMESYNC_MAGIC      0x1435089464683975
 #define TIMESYNC_MACHINES   32
 
+// Samples within this long of a song transfer are suspect
+#define TIMESYNC_BUSY_HOLD  (2 * 1000000)
+
+/*
+ * Warm start.  A peer's time delta is trusted on its own after
+ * TIMESYNC_WARM_SAMPLES clean samples.  A prior from the state file stands in
+ * until then, its error starts at TIMESYNC_PRIOR_ERROR and grows by
+ * TIMESYNC_PRIOR_DRIFT (ppm) of its age.  Priors past TIMESYNC_PRIOR_MAXERR
+ * are dropped.  With a prior TIMESYNC_PRIOR_SAMPLES samples are enough.
+ */
+#define TIMESYNC_WARM_SAMPLES   30
+#define TIMESYNC_PRIOR_SAMPLES  3
+#define TIMESYNC_PRIOR_ERROR    1000
+#define TIMESYNC_PRIOR_DRIFT    20
+#define TIMESYNC_PRIOR_MAXERR   (10 * 1000)
+#define TIMESYNC_SAVE_INTERVAL  60      // Seconds between checkpoints
+#define TIMESYNC_SKEW_INTERVAL  (60 * 1000000)
+#define TIMESYNC_MAX_SKEW       500     // ppm
+
+// TSPkt flags
+#define TSPKT_BUSY          0x1     // Sender is receiving a song
+
+// Bumped with every field appended to TSPkt
+#define TSPKT_VERSION       1
+
+/*
+ * TSPkt -- Time sync announcement.  Fields are only ever appended, so that
+ * speakers of different versions keep syncing during a rolling upgrade: a
+ * shorter packet is accepted as long as it reaches TSPKT_MINLEN and its
+ * missing fields read as zero, a longer one is truncated to what we know.
+ */
 struct TSPkt
 {
     uint64_t magic; // Magic
+    uint32_t group; // Sync Group
+    uint32_t version; // TSPKT_VERSION of the sender
     //uint32_t ip;    // IP Address
     int64_t ts;     // Machine Time
     TSPktMachine machines[TIMESYNC_MACHINES];
+    // Optional, zero when the sender predates them
+    int32_t latency; // Output Latency Compensated at PLAY (us)
+    uint32_t flags; // TSPKT_*
+    uint32_t epoch; // Clock Epoch, see ClockEpoch()
+};
+
+#define TSPKT_MINLEN        offsetof(TSPkt, latency)
+
+/*
+ * TSPrior -- A checkpointed time delta, predicted forward by its skew.
+ */
+struct TSPrior
+{
+    int64_t td;     // Time delta at the checkpoint
+    double skew;    // Drift of the time delta (ppm)
+    int64_t err;    // Uncertainty at
+    int64_t at;     // Local time td and err apply to
+    uint32_t epoch; // Peer clock epoch
 };
 
 class TSMachine
 {
 public:
-    TSMachine() {}
+    TSMachine() : TSMachine(0) {}
     TSMachine(const TSMachine &t) = default;
     TSMachine(uint32_t ip);
     ~TSMachine();
     void dump();
-    void addSample(int64_t localts, int64_t remotets);
+    void addSample(int64_t localts, int64_t remotets, bool busy,
+                   uint32_t epoch);
     bool isLive();
+    bool isSynced();
+    int64_t getAge();
     uint32_t getIP();
     int64_t getTSDelta();
+    void setPrior(const TSPrior &p);
+    void updateSkew();
+    bool getState(TSPrior *p);
     int64_t tdpeer; // Minimum Time Delta from Peer
+    int32_t latency; // Output Latency of Peer
 private:
+    bool predict(int64_t *td, int64_t *err);
+    void dropPrior(const char *why);
     uint32_t ip;
     int64_t lastSeen;
-    std::list<int64_t> ts; // Time Deltas
+    uint32_t epoch;         // Of the samples below
+    int clean;              // Samples not taken during a transfer
+    bool hasPrior;
+    TSPrior prior;
+    int64_t skewTD;         // Time delta and time of the last skew update
+    int64_t skewAt;
+    double skew;            // ppm, valid once skewValid
+    bool skewValid;
+    struct Sample
+    {
+        int64_t td;     // Time Delta
+        bool busy;      // Taken during a song transfer
+    };
+    std::list<Sample> ts;
 };
 
 class TimeSync
@@ -49,17 +134,45 @@ public:
     ~TimeSync();
     void start();
     void stop();
+    void setRealtime(int priority, int cpu);
+    void setRegistry(const std::string &path);
+    void setLatency(int64_t us);
+    void setState(const std::string &path);
+    bool isSynced();
+    void beginTransfer();
+    void endTransfer();
+    bool setNetwork(const std::string &bind, const std::string &peers,
+                    int syncPort, uint32_t syncGroup);
     int64_t getTime();
     void sleepUntil(int64_t ts);
 private:
     void dump();
+    void writeRegistry();
+    void loadState();
+    void saveState();
     void announcer();
+    bool isBusy();
     void processPkt(uint32_t src, const TSPkt &pkt);
     void listener();
+    bool isGroupAddr(uint32_t addr);
     bool done;
+    int rtPriority;
+    int rtCpu;
     uint32_t myIP;
+    uint32_t bindIP;
+    std::vector<uint32_t> peers;
+    int port;
+    uint32_t group;
+    int32_t latency;
+    std::atomic<int> transfers;         // LOADs in progress
+    std::atomic<int64_t> busyUntil;     // End of the last one plus the hold
+    uint32_t epoch;
+    std::string state;
+    std::map<uint32_t, TSPrior> priors;  // Loaded, not yet heard from
     std::thread *thrAnnounce;
     std::thread *thrSync;
+    std::string registry;
+    std::mutex lock; // Protects machines
     std::unordered_map<uint32_t,TSMachine> machines;
 };
 